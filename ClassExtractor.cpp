@@ -0,0 +1,1408 @@
+#include "ClassExtractor.h"
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/DeclTemplate.h"
+#include "clang/AST/RecordLayout.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/PrecompiledPreamble.h"
+#include "clang/Index/USRGeneration.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <map>
+#include <numeric>
+
+using namespace clang;
+using namespace clang::tooling;
+
+// Shares precompiled preambles between TUs for --reuse-preamble. Before the
+// run, the leading preprocessor directives of every source are cut at each
+// directive outside of conditional blocks, and each resulting prefix is
+// counted. A TU then uses the longest prefix of its main file that at least
+// two sources share: the first TU to need it builds a PrecompiledPreamble
+// covering just those bytes, and later TUs with the same prefix and compiler
+// flags load it instead of parsing the prefix again. TUs without a shared
+// prefix, or whose preamble cannot be reused, are parsed normally.
+//
+// A resident store, for a process that parses the same sources again and
+// again, needs no pre-pass: every TU uses all of its leading directives, and
+// a preamble that cannot be reused since a file it covers changed is built
+// again.
+class PreambleStore
+{
+  public:
+    struct Entry
+    {
+        std::once_flag built;
+        llvm::Optional<PrecompiledPreamble> preamble;
+        PreambleBounds bounds{0, false};
+        // Files the preamble was built from, for --cache-dir.
+        std::vector<std::string> deps;
+    };
+
+    explicit PreambleStore(bool resident = false) : m_resident(resident) {}
+
+    // Count the prefixes of a source for the pre-pass.
+    void addSource(llvm::StringRef contents)
+    {
+        for (unsigned point : splitPoints(contents))
+        {
+            m_prefix_counts[llvm::xxHash64(contents.take_front(point))]++;
+        }
+    }
+
+    // Find, and build on first use, the preamble to use for a TU, or return
+    // null if there is none. The entry is shared so that a resident store
+    // can replace it while a TU still uses it.
+    std::shared_ptr<Entry> get(const CompilerInvocation &Invocation,
+                               const llvm::MemoryBuffer &MainBuffer,
+                               llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS,
+                               std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                               DiagnosticConsumer *DiagConsumer)
+    {
+        llvm::StringRef contents = MainBuffer.getBuffer();
+        std::vector<unsigned> points = splitPoints(contents);
+        auto shared = points.rbegin();
+        if (!m_resident)
+        {
+            shared = std::find_if(points.rbegin(), points.rend(), [&](unsigned point) {
+                auto it = m_prefix_counts.find(llvm::xxHash64(contents.take_front(point)));
+                return it != m_prefix_counts.end() && it->second > 1;
+            });
+        }
+        if (shared == points.rend())
+        {
+            return nullptr;
+        }
+        // Split points are the starts of tokens at the start of a line, so the
+        // rest of the file starts a logical line even where the cut follows
+        // indentation or a comment rather than a newline.
+        PreambleBounds bounds(*shared, /*PreambleEndsAtStartOfLine=*/true);
+
+        std::string key = llvm::utohexstr(llvm::xxHash64(contents.take_front(bounds.Size))) +
+                          "-" + flagsKey(Invocation, *VFS);
+        // Returns the entry in the slot, replacing it first if it is stale.
+        auto slot = [&](const std::shared_ptr<Entry> &stale) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::shared_ptr<Entry> &entry = m_entries[key];
+            if (!entry || entry == stale)
+            {
+                entry = std::make_shared<Entry>();
+            }
+            return entry;
+        };
+        auto build = [&](Entry &entry) {
+            std::call_once(entry.built, [&]() {
+                IntrusiveRefCntPtr<DiagnosticsEngine> Diags = CompilerInstance::createDiagnostics(
+                    &Invocation.getDiagnosticOpts(), DiagConsumer, /*ShouldOwnClient=*/false);
+                DepsCollector callbacks(entry.deps);
+                llvm::ErrorOr<PrecompiledPreamble> built = PrecompiledPreamble::Build(
+                    Invocation, &MainBuffer, bounds, *Diags, VFS, PCHContainerOps,
+                    /*StoreInMemory=*/false, callbacks);
+                if (built)
+                {
+                    entry.preamble.emplace(std::move(*built));
+                    entry.bounds = bounds;
+                }
+            });
+            return entry.preamble &&
+                   entry.preamble->CanReuse(Invocation, MainBuffer.getMemBufferRef(),
+                                            entry.bounds, *VFS);
+        };
+
+        std::shared_ptr<Entry> entry = slot(nullptr);
+        if (build(*entry))
+        {
+            return entry;
+        }
+        if (!m_resident)
+        {
+            return nullptr;
+        }
+        entry = slot(entry);
+        return build(*entry) ? entry : nullptr;
+    }
+
+  private:
+    class DepsCollector : public PreambleCallbacks
+    {
+      public:
+        explicit DepsCollector(std::vector<std::string> &deps) : m_deps(deps) {}
+
+        void AfterExecute(CompilerInstance &CI) override
+        {
+            const SourceManager &SM = CI.getSourceManager();
+            for (auto it = SM.fileinfo_begin(); it != SM.fileinfo_end(); ++it)
+            {
+                llvm::StringRef path = it->first->tryGetRealPathName();
+                m_deps.push_back((path.empty() ? it->first->getName() : path).str());
+            }
+        }
+
+      private:
+        std::vector<std::string> &m_deps;
+    };
+
+    // Offsets at which the leading directives of a file can be cut: the
+    // start of every directive outside of a conditional block, and the end
+    // of the last directive.
+    static std::vector<unsigned> splitPoints(llvm::StringRef contents)
+    {
+        // As in Lexer::ComputePreamble, a fake location at offset 1 lets the
+        // raw lexer report offsets.
+        const unsigned StartOffset = 1;
+        LangOptions LangOpts;
+        LangOpts.CPlusPlus = true;
+        Lexer L(SourceLocation::getFromRawEncoding(StartOffset), LangOpts, contents.begin(),
+                contents.begin(), contents.end());
+
+        std::vector<unsigned> points;
+        int depth = 0;
+        bool directive_name = false;
+        Token Tok;
+        for (;;)
+        {
+            L.LexFromRawLexer(Tok);
+            if (Tok.is(tok::eof))
+            {
+                break;
+            }
+            unsigned offset = Tok.getLocation().getRawEncoding() - StartOffset;
+            if (Tok.isAtStartOfLine())
+            {
+                directive_name = false;
+                if (depth == 0 && offset > 0)
+                {
+                    points.push_back(offset);
+                }
+                if (Tok.isNot(tok::hash))
+                {
+                    break;
+                }
+                directive_name = true;
+                continue;
+            }
+            if (directive_name && Tok.is(tok::raw_identifier))
+            {
+                llvm::StringRef name = Tok.getRawIdentifier();
+                if (name == "if" || name == "ifdef" || name == "ifndef")
+                {
+                    depth++;
+                }
+                else if (name == "endif")
+                {
+                    depth--;
+                }
+            }
+            directive_name = false;
+        }
+        return points;
+    }
+
+    // Identifies the compiler flags of a TU, leaving out those that only
+    // name its main file and outputs. The working directory is part of it
+    // since relative include paths depend on it.
+    static std::string flagsKey(const CompilerInvocation &Invocation, llvm::vfs::FileSystem &VFS)
+    {
+        CompilerInvocation copy(Invocation);
+        copy.getFrontendOpts().Inputs.clear();
+        copy.getFrontendOpts().OutputFile.clear();
+        copy.getCodeGenOpts().MainFileName.clear();
+        copy.getDependencyOutputOpts() = DependencyOutputOptions();
+
+        llvm::BumpPtrAllocator alloc;
+        llvm::StringSaver saver(alloc);
+        llvm::SmallVector<const char *, 64> args;
+        copy.generateCC1CommandLine(
+            args, [&](const llvm::Twine &arg) { return saver.save(arg).data(); });
+
+        llvm::ErrorOr<std::string> cwd = VFS.getCurrentWorkingDirectory();
+        std::string flags = cwd ? *cwd : std::string();
+        for (const char *arg : args)
+        {
+            flags += '\0';
+            flags += arg;
+        }
+        return llvm::utohexstr(llvm::xxHash64(flags));
+    }
+
+    bool m_resident;
+    llvm::DenseMap<uint64_t, unsigned> m_prefix_counts;
+    std::mutex m_mutex;
+    std::map<std::string, std::shared_ptr<Entry>> m_entries;
+};
+
+class FindNamedClassVisitor : public RecursiveASTVisitor<FindNamedClassVisitor>
+{
+  private:
+    bool shouldVisit(const std::string &class_name)
+    {
+        if (m_matcher.empty())
+        {
+            // No matching list specified. Visit everything
+            return true;
+        }
+
+        return m_matcher.matches(class_name);
+    }
+
+    // Whether the template mode asks for D. Templates, partial specializations
+    // and the classes nested in them are dependent contexts; everything that
+    // is neither templated nor a specialization is always recorded.
+    bool shouldRecordTemplate(const CXXRecordDecl *D)
+    {
+        if (D->isDependentContext())
+        {
+            return m_options.templates == TemplateMode::Written ||
+                   m_options.templates == TemplateMode::Primary;
+        }
+        switch (D->getTemplateSpecializationKind())
+        {
+        case TSK_Undeclared:
+            return true;
+        case TSK_ImplicitInstantiation:
+            // Only instantiated definitions; a specialization that is merely
+            // named has nothing to record.
+            return m_options.templates == TemplateMode::All && D->hasDefinition();
+        default:
+            return m_options.templates != TemplateMode::Primary;
+        }
+    }
+
+    // Qualified name of a class. Specializations are named with their
+    // arguments, so that they do not share the name of the template. With
+    // TemplateMode::Primary, templates are named with their parameters too;
+    // otherwise they keep their plain name, which exact patterns can name.
+    std::string className(const CXXRecordDecl *D)
+    {
+        std::string name;
+        llvm::raw_string_ostream os(name);
+        const PrintingPolicy &policy = Context->getPrintingPolicy();
+        if (const auto *partial = dyn_cast<ClassTemplatePartialSpecializationDecl>(D))
+        {
+            partial->printQualifiedName(os, policy);
+            printTemplateArgumentList(os, partial->getTemplateArgsAsWritten()->arguments(), policy);
+        }
+        else if (const auto *spec = dyn_cast<ClassTemplateSpecializationDecl>(D))
+        {
+            spec->getNameForDiagnostic(os, policy, /*Qualified=*/true);
+        }
+        else if (m_options.templates == TemplateMode::Primary &&
+                 D->getDescribedClassTemplate() != nullptr)
+        {
+            const ClassTemplateDecl *primary = D->getDescribedClassTemplate();
+            D->printQualifiedName(os, policy);
+            os << '<';
+            unsigned index = 0;
+            for (const NamedDecl *param : *primary->getTemplateParameters())
+            {
+                os << (index ? ", " : "");
+                if (param->getIdentifier() != nullptr)
+                {
+                    os << param->getName();
+                }
+                else
+                {
+                    os << '$' << index;
+                }
+                if (param->isTemplateParameterPack())
+                {
+                    os << "...";
+                }
+                index++;
+            }
+            os << '>';
+        }
+        else
+        {
+            D->printQualifiedName(os, policy);
+        }
+        return os.str();
+    }
+
+    // Whether D may be skipped for lying in a harvested header. Scopes are
+    // always entered; what they contain may come from different files. With
+    // TemplateMode::All, implicit instantiations are only reached through
+    // their template, and belong to whichever TU instantiates them first
+    // however harvested the template's header is, so neither is skipped.
+    bool harvestable(const Decl *D) const
+    {
+        if (isa<TranslationUnitDecl, NamespaceDecl, LinkageSpecDecl>(D))
+        {
+            return false;
+        }
+        if (m_options.templates != TemplateMode::All)
+        {
+            return true;
+        }
+        if (isa<ClassTemplateDecl>(D))
+        {
+            return false;
+        }
+        const auto *record = dyn_cast<CXXRecordDecl>(D);
+        return record == nullptr ||
+               record->getTemplateSpecializationKind() != TSK_ImplicitInstantiation;
+    }
+
+    struct HeaderState
+    {
+        HeaderCache::Key key;
+        bool cacheable;
+        bool skip;
+    };
+
+    // Whether D lives in a header that an earlier TU already harvested. The
+    // answer is computed once per FileID and TU.
+    bool inHarvestedHeader(const Decl *D)
+    {
+        const SourceManager &SM = Context->getSourceManager();
+        FileID FID = SM.getFileID(SM.getExpansionLoc(D->getLocation()));
+        if (FID.isInvalid() || FID == SM.getMainFileID())
+        {
+            return false;
+        }
+
+        auto inserted = m_headers.try_emplace(FID, HeaderState());
+        HeaderState &state = inserted.first->second;
+        if (inserted.second)
+        {
+            const FileEntry *FE = SM.getFileEntryForID(FID);
+            llvm::Optional<llvm::MemoryBufferRef> Buffer = SM.getBufferOrNone(FID);
+            state.cacheable = FE != nullptr && Buffer.hasValue();
+            state.skip = false;
+            if (state.cacheable)
+            {
+                state.key = {FE->getUniqueID(), llvm::xxHash64(Buffer->getBuffer())};
+                state.skip = m_target.headers->harvestedBefore(state.key, m_target.tu);
+            }
+        }
+        return state.skip;
+    }
+
+    // The real path of a file where possible, as for the dependencies of the
+    // cache.
+    static llvm::StringRef filePath(const FileEntry *FE)
+    {
+        llvm::StringRef path = FE->tryGetRealPathName();
+        return path.empty() ? FE->getName() : path;
+    }
+
+    // The file that D is in, or null.
+    const FileEntry *declFile(const Decl *D)
+    {
+        const SourceManager &SM = Context->getSourceManager();
+        return SM.getFileEntryForID(SM.getFileID(SM.getExpansionLoc(D->getLocation())));
+    }
+
+    // Record the file and line of D as the location of cdb.
+    void setLocation(ClassDatabase &cdb, const Decl *D)
+    {
+        const SourceManager &SM = Context->getSourceManager();
+        SourceLocation Loc = SM.getExpansionLoc(D->getLocation());
+        const FileEntry *FE = SM.getFileEntryForID(SM.getFileID(Loc));
+        if (FE == nullptr)
+        {
+            return;
+        }
+        m_target.tdb.setLocation(cdb, filePath(FE), SM.getExpansionLineNumber(Loc));
+    }
+
+    // Record the files that the signature of Definition depends on.
+    void setSignatureFiles(ClassDatabase &cdb, const CXXRecordDecl *Definition)
+    {
+        std::vector<llvm::StringRef> paths;
+        for (const FileEntry *FE : m_signatures[recordKey(Definition)].files)
+        {
+            paths.push_back(filePath(FE));
+        }
+        llvm::sort(paths);
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        m_target.tdb.setSignatureFiles(cdb, paths);
+    }
+
+    const Type *recordKey(const CXXRecordDecl *Definition)
+    {
+        return Context->getCanonicalType(Context->getRecordType(Definition)).getTypePtr();
+    }
+
+    // A signature and the files it depends on: those of the class, of the
+    // classes folded into it and of the typedefs and enumerations its fields
+    // are spelled with, so that a depfile can name every header whose edit
+    // may change it.
+    struct Signature
+    {
+        uint64_t hash = 0;
+        std::vector<const FileEntry *> files;
+    };
+
+    void addFile(std::vector<const FileEntry *> &files, const Decl *D)
+    {
+        if (const FileEntry *FE = declFile(D))
+        {
+            files.push_back(FE);
+        }
+    }
+
+    // Add the files of the signature of the class that T names, if any.
+    void addRecordFiles(std::vector<const FileEntry *> &files, QualType T)
+    {
+        const CXXRecordDecl *record = T->getAsCXXRecordDecl();
+        if (record == nullptr || !record->hasDefinition())
+        {
+            return;
+        }
+        auto it = m_signatures.find(recordKey(record->getDefinition()));
+        if (it != m_signatures.end())
+        {
+            files.insert(files.end(), it->second.files.begin(), it->second.files.end());
+        }
+    }
+
+    // Add the files of the typedefs and enumerations that T, or the element
+    // type of an array type, is spelled with.
+    void addTypeFiles(std::vector<const FileEntry *> &files, QualType T)
+    {
+        for (;;)
+        {
+            if (const auto *Typedef = dyn_cast<TypedefType>(T.getTypePtr()))
+            {
+                addFile(files, Typedef->getDecl());
+            }
+            else if (const auto *Enum = dyn_cast<EnumType>(T.getTypePtr()))
+            {
+                addFile(files, Enum->getDecl());
+            }
+            else if (const auto *Array = dyn_cast<ArrayType>(T.getTypePtr()))
+            {
+                T = Array->getElementType();
+                continue;
+            }
+            QualType Next = T.getSingleStepDesugaredType(*Context);
+            if (Next == T)
+            {
+                return;
+            }
+            T = Next;
+        }
+    }
+
+    // Signature of a class definition: its bases, then its fields, with
+    // record-typed bases and fields folded in by their own signature. A field
+    // counts with its name, its canonical type and its bit width, so that
+    // changing what a typedef or a constant stands for changes the signature,
+    // but not how the type is spelled. Results are memoized per canonical
+    // type, so a type shared by many classes of the TU is only expanded once.
+    uint64_t recordSignature(const CXXRecordDecl *Definition)
+    {
+        const Type *key = recordKey(Definition);
+        // The placeholder also ends the recursion for invalid, self-containing
+        // records.
+        auto inserted = m_signatures.try_emplace(key);
+        if (!inserted.second)
+        {
+            return inserted.first->second.hash;
+        }
+        std::vector<const FileEntry *> files;
+        addFile(files, Definition);
+
+        // Strings are NUL-terminated and everything else has a fixed width,
+        // which makes the encoding unambiguous.
+        llvm::SmallString<256> encoding;
+        auto appendHash = [&encoding](uint64_t value) {
+            char bytes[sizeof(value)];
+            llvm::support::endian::write64le(bytes, value);
+            encoding.append(bytes, bytes + sizeof(bytes));
+        };
+        appendHash(Definition->getNumBases());
+        for (const CXXBaseSpecifier &base : Definition->bases())
+        {
+            appendHash(typeSignature(base.getType()));
+            encoding.push_back(base.isVirtual() ? 'v' : '-');
+            addRecordFiles(files, base.getType());
+        }
+        for (const FieldDecl *fdcl : Definition->fields())
+        {
+            FieldType type = fieldType(fdcl->getType());
+            addRecordFiles(files, Context->getBaseElementType(fdcl->getType()));
+            addTypeFiles(files, fdcl->getType());
+            appendHash(type.canonical);
+            encoding += fdcl->getQualifiedNameAsString();
+            encoding.push_back('\0');
+            appendHash(type.signature);
+            // The width of a bit-field is only known outside of templates.
+            if (fdcl->isBitField() && !fdcl->getBitWidth()->isValueDependent())
+            {
+                encoding.push_back('b');
+                appendHash(fdcl->getBitWidthValue(*Context));
+            }
+            else
+            {
+                encoding.push_back('-');
+            }
+        }
+
+        llvm::sort(files);
+        files.erase(std::unique(files.begin(), files.end()), files.end());
+        uint64_t signature = llvm::xxHash64(encoding);
+        Signature &memo = m_signatures[key];
+        memo.hash = signature;
+        memo.files = std::move(files);
+        return signature;
+    }
+
+    // Layout of a complete, non-dependent class definition.
+    RecordLayout recordLayout(const CXXRecordDecl *Definition, const ASTRecordLayout &layout)
+    {
+        RecordLayout result;
+        result.size = layout.getSize().getQuantity();
+        result.alignment = layout.getAlignment().getQuantity();
+        result.trivially_copyable = Definition->isTriviallyCopyable();
+        result.standard_layout = Definition->isStandardLayout();
+
+        // Bit ranges, as begin and end, of everything the object holds. A
+        // base counts with all of its non-virtual part.
+        std::vector<std::pair<uint64_t, uint64_t>> occupied;
+        if (layout.hasOwnVFPtr())
+        {
+            occupied.emplace_back(0, Context->getTypeSize(Context->VoidPtrTy));
+        }
+        auto addBase = [&](const CXXRecordDecl *base, CharUnits offset) {
+            uint64_t begin = Context->toBits(offset);
+            CharUnits size = Context->getASTRecordLayout(base).getNonVirtualSize();
+            occupied.emplace_back(begin, begin + Context->toBits(size));
+        };
+        for (const CXXBaseSpecifier &base : Definition->bases())
+        {
+            if (!base.isVirtual())
+            {
+                const CXXRecordDecl *record = base.getType()->getAsCXXRecordDecl();
+                addBase(record, layout.getBaseClassOffset(record));
+            }
+        }
+        for (const CXXBaseSpecifier &base : Definition->vbases())
+        {
+            const CXXRecordDecl *record = base.getType()->getAsCXXRecordDecl();
+            addBase(record, layout.getVBaseClassOffset(record));
+        }
+        for (const FieldDecl *fdcl : Definition->fields())
+        {
+            uint64_t begin = layout.getFieldOffset(fdcl->getFieldIndex());
+            occupied.emplace_back(begin, begin + fieldSize(fdcl));
+        }
+
+        std::sort(occupied.begin(), occupied.end());
+        uint64_t end = 0;
+        for (const auto &range : occupied)
+        {
+            if (range.first > end)
+            {
+                result.padding.emplace_back(end, range.first - end);
+            }
+            end = std::max(end, range.second);
+        }
+        uint64_t size = Context->toBits(layout.getSize());
+        if (size > end)
+        {
+            result.padding.emplace_back(end, size - end);
+        }
+        return result;
+    }
+
+    // Bits a field occupies.
+    uint64_t fieldSize(const FieldDecl *fdcl)
+    {
+        return fdcl->isBitField() ? fdcl->getBitWidthValue(*Context)
+                                  : Context->getTypeSize(fdcl->getType());
+    }
+
+    // The spelling of a field type, interned in the TU's database, the hash
+    // of its canonical type and the signature of the class its elements are,
+    // if any.
+    struct FieldType
+    {
+        llvm::StringRef spelling;
+        uint64_t canonical = 0;
+        uint64_t signature = 0;
+        bool signature_known = false;
+    };
+
+    // Printing a type is costly for deep template specializations, and the
+    // same field types recur throughout a TU, so both parts are cached per
+    // type as written; sugar is kept in the key since the spelling differs
+    // with it. A zero signature may be the placeholder of a class still
+    // being hashed, so it is looked up again the next time.
+    FieldType fieldType(QualType T)
+    {
+        auto it = m_field_types.find(T);
+        if (it != m_field_types.end() && it->second.signature_known)
+        {
+            return it->second;
+        }
+        FieldType type;
+        type.spelling = it != m_field_types.end() ? it->second.spelling
+                                                  : m_target.tdb.intern(T.getAsString());
+        type.canonical = it != m_field_types.end() ? it->second.canonical : canonicalHash(T);
+        // This may hash other classes, and so insert into m_field_types.
+        type.signature = typeSignature(Context->getBaseElementType(T));
+        type.signature_known = type.signature != 0;
+        m_field_types[T] = type;
+        return type;
+    }
+
+    // Hash of what a type is rather than how it is written: its canonical
+    // type, where typedefs are resolved and array bounds and template
+    // arguments evaluated, and for enumerations their underlying type.
+    // Unnamed classes are printed without their location, which differs
+    // between checkouts; their own signature is folded in anyway.
+    uint64_t canonicalHash(QualType T)
+    {
+        QualType Canonical = Context->getCanonicalType(T);
+        auto it = m_canonical_hashes.find(Canonical);
+        if (it != m_canonical_hashes.end())
+        {
+            return it->second;
+        }
+        PrintingPolicy policy = Context->getPrintingPolicy();
+        policy.AnonymousTagLocations = false;
+        std::string encoding = Canonical.getAsString(policy);
+        if (const auto *Enum = Context->getBaseElementType(Canonical)->getAs<EnumType>())
+        {
+            QualType Underlying = Enum->getDecl()->getIntegerType();
+            if (!Underlying.isNull())
+            {
+                encoding.push_back('\0');
+                encoding += Context->getCanonicalType(Underlying).getAsString(policy);
+            }
+        }
+        uint64_t hash = llvm::xxHash64(encoding);
+        m_canonical_hashes[Canonical] = hash;
+        return hash;
+    }
+
+    // Signature of the class a type names, or 0 for any other type.
+    uint64_t typeSignature(QualType T)
+    {
+        const CXXRecordDecl *record = T->getAsCXXRecordDecl();
+        if (record == nullptr || !record->hasDefinition())
+        {
+            return 0;
+        }
+        return recordSignature(record->getDefinition());
+    }
+
+  public:
+    FindNamedClassVisitor(ASTContext *Context, const ClassExtractor &extractor,
+                          const ExtractionTarget &target)
+        : Context(Context), m_options(extractor.options()), m_matcher(extractor.matcher()),
+          m_target(target)
+    {
+    }
+
+    // Implicit instantiations are only reached with TemplateMode::All.
+    bool shouldVisitTemplateInstantiations() const
+    {
+        return m_options.templates == TemplateMode::All;
+    }
+
+    // With prefix or exact patterns, namespaces that cannot contain a match
+    // are not entered at all. Inline namespaces do not appear in qualified
+    // names, so they are always entered.
+    bool TraverseNamespaceDecl(NamespaceDecl *D)
+    {
+        if (!D->isInline())
+        {
+            const NamespaceDecl *canonical = D->getCanonicalDecl();
+            auto inserted = m_namespaces.try_emplace(canonical, true);
+            if (inserted.second)
+            {
+                inserted.first->second =
+                    m_matcher.canMatchWithin(canonical->getQualifiedNameAsString() + "::");
+            }
+            if (!inserted.first->second)
+            {
+                return true;
+            }
+        }
+        return RecursiveASTVisitor<FindNamedClassVisitor>::TraverseNamespaceDecl(D);
+    }
+
+    bool TraverseDecl(Decl *D)
+    {
+        if (D != nullptr && m_options.skip_system_headers && !isa<TranslationUnitDecl>(D) &&
+            Context->getSourceManager().isInSystemHeader(D->getLocation()))
+        {
+            return true;
+        }
+        if (D != nullptr && m_target.headers != nullptr && harvestable(D) &&
+            inHarvestedHeader(D))
+        {
+            return true;
+        }
+        return RecursiveASTVisitor<FindNamedClassVisitor>::TraverseDecl(D);
+    }
+
+    // Record every header this TU traversed as harvested, and collect the
+    // files the TU read.
+    void finishTranslationUnit()
+    {
+        if (m_target.deps != nullptr)
+        {
+            const SourceManager &SM = Context->getSourceManager();
+            for (auto it = SM.fileinfo_begin(); it != SM.fileinfo_end(); ++it)
+            {
+                llvm::StringRef path = it->first->tryGetRealPathName();
+                m_target.deps->insert(path.empty() ? it->first->getName() : path);
+            }
+        }
+        if (m_target.headers == nullptr)
+        {
+            return;
+        }
+        for (const auto &entry : m_headers)
+        {
+            if (entry.second.cacheable && !entry.second.skip)
+            {
+                m_target.headers->markHarvested(entry.second.key, m_target.tu);
+            }
+        }
+    }
+
+    bool VisitCXXRecordDecl(CXXRecordDecl *Declaration)
+    {
+        if (m_options.skip_function_bodies && !Declaration->isThisDeclarationADefinition())
+        {
+            return true;
+        }
+        if (m_target.stats)
+        {
+            m_target.stats->records_visited++;
+        }
+        if (!shouldRecordTemplate(Declaration))
+        {
+            return true;
+        }
+        std::string name = className(Declaration);
+        if (!shouldVisit(name))
+        {
+            return true;
+        }
+        if (m_target.stats)
+        {
+            m_target.stats->records_matched++;
+        }
+
+        // Every redeclaration of a class is visited, and all of them share
+        // the USR. Record the class once, with the fields of its definition.
+        const CXXRecordDecl *Definition = Declaration->getDefinition();
+        uint64_t signature = Definition ? recordSignature(Definition) : 0;
+        llvm::SmallString<128> usr;
+        if (index::generateUSRForDecl(Declaration, usr))
+        {
+            usr.clear();
+        }
+
+        ClassDatabase *existing = usr.empty() ? nullptr : m_target.tdb.findClass(usr);
+        if (existing != nullptr && (existing->hasDefinition() || Definition == nullptr))
+        {
+            if (Definition != nullptr && existing->signature() != signature)
+            {
+                m_target.registry.reportODRConflict(usr, name);
+            }
+            return true;
+        }
+        if (!usr.empty() &&
+            !m_target.registry.claim(usr, name, m_target.tu, Definition != nullptr, signature) &&
+            m_target.skip_claimed)
+        {
+            return true;
+        }
+
+        ClassDatabase &cdb = existing ? *existing : m_target.tdb.addClass(name, usr);
+        setLocation(cdb, Definition ? Definition : Declaration);
+        if (Definition == nullptr)
+        {
+            return true;
+        }
+        cdb.setDefinition(signature);
+        setSignatureFiles(cdb, Definition);
+        // Only complete types have a layout.
+        const ASTRecordLayout *layout = nullptr;
+        if (m_options.layout && !Definition->isDependentType() && !Definition->isInvalidDecl())
+        {
+            layout = &Context->getASTRecordLayout(Definition);
+            cdb.setLayout(recordLayout(Definition, *layout));
+        }
+        llvm::MutableArrayRef<FieldDatabase> fields = m_target.tdb.setFields(
+            cdb, std::distance(Definition->field_begin(), Definition->field_end()));
+        FieldDatabase *fdb_it = fields.begin();
+        for (const FieldDecl *fdcl : Definition->fields())
+        {
+            FieldDatabase &fdb = *fdb_it++;
+            fdb.type = fieldType(fdcl->getType()).spelling;
+            fdb.variable = m_target.tdb.intern(fdcl->getQualifiedNameAsString());
+            if (layout != nullptr)
+            {
+                fdb.offset = layout->getFieldOffset(fdcl->getFieldIndex());
+                fdb.size = fieldSize(fdcl);
+            }
+        }
+        if (m_target.stats)
+        {
+            m_target.stats->fields += fields.size();
+        }
+        return true;
+    }
+
+  private:
+    ASTContext *Context;
+    const ExtractorOptions &m_options;
+    const ClassMatcher &m_matcher;
+    ExtractionTarget m_target;
+    llvm::DenseMap<FileID, HeaderState> m_headers;
+    llvm::DenseMap<const NamespaceDecl *, bool> m_namespaces;
+    llvm::DenseMap<const Type *, Signature> m_signatures;
+    llvm::DenseMap<QualType, FieldType> m_field_types;
+    llvm::DenseMap<QualType, uint64_t> m_canonical_hashes;
+};
+
+// The classes the exact -m patterns name, found by name lookup instead of
+// traversal. Returns false if some pattern cannot be looked up this way, such
+// as a specialization, whose name carries template arguments, or a class in
+// an anonymous namespace.
+static bool lookup_exact_classes(ASTContext &Context, const ExtractorOptions &options,
+                                 std::vector<Decl *> &found)
+{
+    if (options.match_kind != MatchKind::Exact || options.patterns.empty())
+    {
+        return false;
+    }
+    for (const std::string &pattern : options.patterns)
+    {
+        if (llvm::StringRef(pattern).find_first_of("<>() ") != llvm::StringRef::npos)
+        {
+            return false;
+        }
+        llvm::SmallVector<llvm::StringRef, 4> parts;
+        llvm::StringRef(pattern).split(parts, "::");
+        std::vector<DeclContext *> scopes{Context.getTranslationUnitDecl()};
+        for (size_t i = 0; i < parts.size() && !scopes.empty(); ++i)
+        {
+            bool last = i + 1 == parts.size();
+            std::vector<DeclContext *> inner;
+            for (DeclContext *scope : scopes)
+            {
+                for (NamedDecl *D : scope->lookup(&Context.Idents.get(parts[i])))
+                {
+                    auto *record = dyn_cast<CXXRecordDecl>(D);
+                    if (const auto *primary = dyn_cast<ClassTemplateDecl>(D))
+                    {
+                        record = primary->getTemplatedDecl();
+                    }
+                    if (last && record != nullptr)
+                    {
+                        // Prefer the definition; with --fast, nothing else
+                        // is recorded.
+                        found.push_back(record->hasDefinition() ? record->getDefinition() : record);
+                    }
+                    else if (!last && record != nullptr)
+                    {
+                        inner.push_back(record);
+                    }
+                    else if (!last && isa<NamespaceDecl>(D))
+                    {
+                        inner.push_back(cast<DeclContext>(D));
+                    }
+                }
+            }
+            scopes = std::move(inner);
+        }
+    }
+    return true;
+}
+
+class FindNamedClassConsumer : public clang::ASTConsumer
+{
+  public:
+    FindNamedClassConsumer(ASTContext *Context, const ClassExtractor &extractor,
+                           const ExtractionTarget &target)
+        : Visitor(Context, extractor, target), m_options(extractor.options()),
+          m_stats(target.stats)
+    {
+    }
+
+    virtual void HandleTranslationUnit(clang::ASTContext &Context)
+    {
+        traverse({Context.getTranslationUnitDecl()});
+    }
+
+    // For a deserialized TU, where every declaration the traversal reaches
+    // is read from the AST file on demand: with exact patterns, only the
+    // named classes and their scopes are read.
+    void HandleSerializedTranslationUnit(clang::ASTContext &Context)
+    {
+        std::vector<Decl *> classes;
+        if (!lookup_exact_classes(Context, m_options, classes))
+        {
+            HandleTranslationUnit(Context);
+            return;
+        }
+        traverse(classes);
+    }
+
+  private:
+    void traverse(llvm::ArrayRef<Decl *> roots)
+    {
+        llvm::TimeTraceScope scope("Traverse");
+        auto start = std::chrono::steady_clock::now();
+        for (Decl *D : roots)
+        {
+            Visitor.TraverseDecl(D);
+        }
+        Visitor.finishTranslationUnit();
+        if (m_stats)
+        {
+            m_stats->traverse +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    FindNamedClassVisitor Visitor;
+    const ExtractorOptions &m_options;
+    TUStats *m_stats;
+};
+
+class FindNamedClassAction : public clang::ASTFrontendAction
+{
+  public:
+    FindNamedClassAction(const ClassExtractor &extractor, const ExtractionTarget &target)
+        : m_extractor(extractor), m_target(target)
+    {
+    }
+
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler,
+                                                                  llvm::StringRef InFile)
+    {
+        if (m_extractor.options().skip_function_bodies)
+        {
+            // Record layouts never depend on function bodies.
+            Compiler.getFrontendOpts().SkipFunctionBodies = true;
+        }
+        return std::unique_ptr<clang::ASTConsumer>(
+            new FindNamedClassConsumer(&Compiler.getASTContext(), m_extractor, m_target));
+    }
+
+  private:
+    const ClassExtractor &m_extractor;
+    ExtractionTarget m_target;
+};
+
+// Creates actions that record into a given ToolDatabase, so that every worker
+// can fill its own database without synchronization.
+class FindNamedClassActionFactory : public FrontendActionFactory
+{
+  public:
+    FindNamedClassActionFactory(const ClassExtractor &extractor, PreambleStore *preambles,
+                                const ExtractionTarget &target)
+        : m_extractor(extractor), m_preambles(preambles), m_target(target)
+    {
+    }
+
+    std::unique_ptr<FrontendAction> create() override
+    {
+        return std::unique_ptr<FrontendAction>(new FindNamedClassAction(m_extractor, m_target));
+    }
+
+    // When reusing preambles, point the invocation at a shared preamble
+    // before running it.
+    bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation, FileManager *Files,
+                       std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                       DiagnosticConsumer *DiagConsumer) override
+    {
+        if (!m_preambles || Invocation->getFrontendOpts().Inputs.size() != 1 ||
+            !Invocation->getFrontendOpts().Inputs[0].isFile())
+        {
+            return FrontendActionFactory::runInvocation(Invocation, Files, PCHContainerOps,
+                                                        DiagConsumer);
+        }
+
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> MainBuffer =
+            Files->getBufferForFile(Invocation->getFrontendOpts().Inputs[0].getFile());
+        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS(&Files->getVirtualFileSystem());
+        std::shared_ptr<PreambleStore::Entry> entry =
+            MainBuffer ? m_preambles->get(*Invocation, **MainBuffer, VFS, PCHContainerOps,
+                                          DiagConsumer)
+                       : nullptr;
+        if (entry == nullptr)
+        {
+            return FrontendActionFactory::runInvocation(Invocation, Files, PCHContainerOps,
+                                                        DiagConsumer);
+        }
+
+        // The preamble remaps the main file to MainBuffer, which we own.
+        entry->preamble->AddImplicitPreamble(*Invocation, VFS, MainBuffer->get());
+        Invocation->getPreprocessorOpts().RetainRemappedFileBuffers = true;
+        if (m_target.deps != nullptr)
+        {
+            m_target.deps->insert(entry->deps.begin(), entry->deps.end());
+        }
+
+        llvm::IntrusiveRefCntPtr<FileManager> PreambleFiles(Files);
+        if (VFS.get() != &Files->getVirtualFileSystem())
+        {
+            PreambleFiles = new FileManager(Files->getFileSystemOpts(), VFS);
+        }
+        return FrontendActionFactory::runInvocation(Invocation, PreambleFiles.get(),
+                                                    PCHContainerOps, DiagConsumer);
+    }
+
+  private:
+    const ClassExtractor &m_extractor;
+    PreambleStore *m_preambles;
+    ExtractionTarget m_target;
+};
+
+// A file name reduced for comparison with class and file names: lowercase,
+// without the extension and without '_' and '-'.
+static std::string name_key(llvm::StringRef path)
+{
+    std::string key;
+    for (char c : llvm::sys::path::stem(path))
+    {
+        if (c != '_' && c != '-')
+        {
+            key += llvm::toLower(c);
+        }
+    }
+    return key;
+}
+
+// How likely Source is to define the classes of the patterns, for
+// stop_when_found: a source named like one of the classes, or like one of
+// the hint files, scores highest, then one in the directory of a hint file,
+// then one whose path mentions the namespaces of the classes.
+static unsigned source_likelihood(llvm::StringRef Source, const ExtractorOptions &options)
+{
+    std::string path = llvm::sys::path::convert_to_slash(Source);
+    std::string lower = llvm::StringRef(path).lower();
+    std::string key = name_key(path);
+    unsigned score = 0;
+    for (const std::string &hint : options.hint_files)
+    {
+        std::string hint_path = llvm::sys::path::convert_to_slash(hint);
+        if (name_key(hint_path) == key)
+        {
+            score += 4;
+        }
+        if (llvm::sys::path::parent_path(hint_path) == llvm::sys::path::parent_path(path))
+        {
+            score += 2;
+        }
+    }
+    for (const std::string &pattern : options.patterns)
+    {
+        llvm::SmallVector<llvm::StringRef, 4> parts;
+        llvm::StringRef(pattern).split(parts, "::");
+        if (name_key(parts.back()) == key)
+        {
+            score += 4;
+        }
+        parts.pop_back();
+        for (llvm::StringRef part : parts)
+        {
+            if (lower.find("/" + part.lower() + "/") != std::string::npos)
+            {
+                score += 1;
+            }
+        }
+    }
+    return score;
+}
+
+// The order in which run() starts the sources. Each idle worker takes the
+// next source that has not been started, so starting the costliest ones
+// first keeps a long TU from starting last and holding up the end of the
+// run. With stop_when_found, the likeliest sources go first instead, with
+// cost only breaking ties.
+static std::vector<size_t> schedule_sources(const std::vector<std::string> &Sources,
+                                            const ExtractorOptions &options)
+{
+    std::vector<size_t> order(Sources.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (!options.source_costs.empty())
+    {
+        auto cost = [&](size_t i) {
+            auto it = options.source_costs.find(Sources[i]);
+            return it == options.source_costs.end() ? std::numeric_limits<double>::infinity()
+                                                    : it->second;
+        };
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t lhs, size_t rhs) { return cost(lhs) > cost(rhs); });
+    }
+    if (options.stop_when_found)
+    {
+        std::vector<unsigned> scores(Sources.size());
+        for (size_t i = 0; i < Sources.size(); ++i)
+        {
+            scores[i] = source_likelihood(Sources[i], options);
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t lhs, size_t rhs) { return scores[lhs] > scores[rhs]; });
+    }
+    return order;
+}
+
+// Databases that run() holds, per worker thread, for sources that were
+// started out of source order and wait for an earlier one to be consumed.
+static const size_t HeldResultsPerThread = 4;
+
+// Combine ClangTool::run results: 1 if any TU failed, else 2 if any file was
+// skipped, else 0.
+static int combine_results(int lhs, int rhs)
+{
+    if (lhs == 1 || rhs == 1)
+    {
+        return 1;
+    }
+    return lhs != 0 ? lhs : rhs;
+}
+
+ClassExtractor::ClassExtractor(ExtractorOptions options) : m_options(std::move(options)) {}
+
+ClassExtractor::~ClassExtractor() {}
+
+bool ClassExtractor::init(std::string &error)
+{
+    if (m_options.stop_when_found &&
+        (m_options.match_kind != MatchKind::Exact || m_options.patterns.empty()))
+    {
+        error = "stop_when_found needs exact patterns";
+        return false;
+    }
+    return m_matcher.compile(m_options.match_kind, m_options.patterns, error);
+}
+
+int ClassExtractor::run(const CompilationDatabase &Compilations,
+                        const std::vector<std::string> &Sources, ResultSink &sink)
+{
+    if (m_options.reuse_preamble)
+    {
+        m_preambles.reset(new PreambleStore());
+        for (const std::string &Source : Sources)
+        {
+            if (llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+                    llvm::MemoryBuffer::getFile(Source))
+            {
+                m_preambles->addSource(buffer.get()->getBuffer());
+            }
+        }
+    }
+
+    // Sources are taken in order from the pool's queue. With stop_when_found,
+    // that holds even for a single job, so the pool then has one worker.
+    if ((m_options.jobs == 1 && !m_options.stop_when_found) || Sources.size() <= 1)
+    {
+        int result = 0;
+        for (size_t i = 0; i < Sources.size(); ++i)
+        {
+            ToolDatabase tdb;
+            result = combine_results(result, extractSource(Compilations, Sources[i], i, tdb,
+                                                           llvm::vfs::getRealFileSystem()));
+            sink.consume(std::move(tdb));
+        }
+        return result;
+    }
+
+    std::vector<size_t> order = schedule_sources(Sources, m_options);
+    llvm::ThreadPoolStrategy strategy = llvm::hardware_concurrency(m_options.jobs);
+    const size_t MaxHeld = HeldResultsPerThread * strategy.compute_thread_count();
+    // With stop_when_found, the patterns whose class no TU has defined yet.
+    llvm::StringSet<> unresolved;
+    unresolved.insert(m_options.patterns.begin(), m_options.patterns.end());
+    std::vector<ToolDatabase> shards(Sources.size());
+    std::vector<int> results(Sources.size(), 0);
+    std::vector<bool> started(Sources.size(), false);
+    std::vector<bool> done(Sources.size(), false);
+    // Sources started but not consumed yet, and the first position in order
+    // that may not have been started.
+    size_t held = 0;
+    size_t next_in_order = 0;
+    size_t next_to_consume = 0;
+    std::mutex consume_mutex;
+    std::condition_variable consumed;
+    {
+        llvm::ThreadPool Pool(strategy);
+        for (size_t task = 0; task < Sources.size(); ++task)
+        {
+            Pool.async([&]() {
+                // Start the next source of the schedule, unless MaxHeld
+                // databases already wait to be consumed: then only the
+                // source they wait for may start, and until it is done,
+                // the worker waits. A skipped source is never held long.
+                size_t i;
+                bool skip;
+                {
+                    std::unique_lock<std::mutex> lock(consume_mutex);
+                    for (;;)
+                    {
+                        skip = m_options.stop_when_found && unresolved.empty();
+                        if (skip || held < MaxHeld)
+                        {
+                            while (started[order[next_in_order]])
+                            {
+                                next_in_order++;
+                            }
+                            i = order[next_in_order];
+                            break;
+                        }
+                        if (!started[next_to_consume])
+                        {
+                            i = next_to_consume;
+                            break;
+                        }
+                        consumed.wait(lock);
+                    }
+                    started[i] = true;
+                    held++;
+                }
+                if (!skip)
+                {
+                    // Each worker needs its own file system so that ClangTool
+                    // can change the working directory per compile command.
+                    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS =
+                        llvm::vfs::createPhysicalFileSystem();
+                    results[i] = extractSource(Compilations, Sources[i], i, shards[i], FS);
+                }
+
+                std::lock_guard<std::mutex> lock(consume_mutex);
+                if (m_options.stop_when_found)
+                {
+                    for (const ClassDatabase &cdb : shards[i].classes())
+                    {
+                        if (cdb.hasDefinition())
+                        {
+                            unresolved.erase(cdb.name_ref());
+                        }
+                    }
+                }
+                done[i] = true;
+                size_t first_to_consume = next_to_consume;
+                while (next_to_consume < Sources.size() && done[next_to_consume])
+                {
+                    sink.consume(std::move(shards[next_to_consume]));
+                    shards[next_to_consume] = ToolDatabase();
+                    next_to_consume++;
+                    held--;
+                }
+                if (next_to_consume != first_to_consume)
+                {
+                    consumed.notify_all();
+                }
+            });
+        }
+        Pool.wait();
+    }
+
+    int result = 0;
+    for (int r : results)
+    {
+        result = combine_results(result, r);
+    }
+    return result;
+}
+
+int ClassExtractor::run(const CompilationDatabase &Compilations,
+                        const std::vector<std::string> &Sources, ToolDatabase &tdb)
+{
+    MergingSink sink(tdb);
+    int result = run(Compilations, Sources, sink);
+    tdb.markODRConflicts(m_registry);
+    return result;
+}
+
+int ClassExtractor::run(const CompilationDatabase &Compilations,
+                        const std::vector<std::string> &Sources,
+                        std::function<void(const ClassDatabase &)> callback)
+{
+    ClassStreamSink sink(std::move(callback));
+    int result = run(Compilations, Sources, sink);
+    sink.finish();
+    return result;
+}
+
+// Serialized ASTs as written by -emit-ast or -emit-pch.
+bool ClassExtractor::isASTFile(llvm::StringRef Source)
+{
+    llvm::StringRef extension = llvm::sys::path::extension(Source);
+    return extension == ".ast" || extension == ".pch";
+}
+
+int ClassExtractor::extractSource(const CompilationDatabase &Compilations,
+                                  const std::string &Source, unsigned tu, ToolDatabase &tdb,
+                                  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+{
+    HeaderCache *headers = m_options.skip_harvested_headers ? &m_headers : nullptr;
+    return extract(Compilations, Source, {tdb, m_registry, headers, tu, true, nullptr, nullptr},
+                   FS);
+}
+
+int ClassExtractor::extract(const CompilationDatabase &Compilations, const std::string &Source,
+                            const ExtractionTarget &target,
+                            llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS) const
+{
+    if (isASTFile(Source))
+    {
+        return extractAST(Source, target);
+    }
+    ClangTool Tool(Compilations, {Source}, std::make_shared<PCHContainerOperations>(), FS);
+    FindNamedClassActionFactory Factory(*this, m_preambles.get(), target);
+    return Tool.run(&Factory);
+}
+
+void ClassExtractor::retainPreambles() { m_preambles.reset(new PreambleStore(/*resident=*/true)); }
+
+std::unique_ptr<FrontendActionFactory>
+ClassExtractor::newActionFactory(const ExtractionTarget &target) const
+{
+    return std::unique_ptr<FrontendActionFactory>(
+        new FindNamedClassActionFactory(*this, m_preambles.get(), target));
+}
+
+// Extract the classes of a serialized AST without running the parser.
+// Declarations are deserialized lazily, as the visitor reaches them.
+int ClassExtractor::extractAST(const std::string &Source, const ExtractionTarget &target) const
+{
+    llvm::IntrusiveRefCntPtr<DiagnosticsEngine> Diags =
+        CompilerInstance::createDiagnostics(new DiagnosticOptions());
+    PCHContainerOperations PCHContainerOps;
+    std::unique_ptr<ASTUnit> AST =
+        ASTUnit::LoadFromASTFile(Source, PCHContainerOps.getRawReader(), ASTUnit::LoadASTOnly,
+                                 Diags, FileSystemOptions());
+    if (!AST)
+    {
+        llvm::errs() << "Failed to load AST file " << Source << "\n";
+        return 1;
+    }
+    FindNamedClassConsumer Consumer(&AST->getASTContext(), *this, target);
+    Consumer.HandleSerializedTranslationUnit(AST->getASTContext());
+    return 0;
+}
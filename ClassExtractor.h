@@ -0,0 +1,367 @@
+#ifndef CLASS_SIGNATURE_CLASSEXTRACTOR_H
+#define CLASS_SIGNATURE_CLASSEXTRACTOR_H
+
+#include "ClassMatcher.h"
+#include "ToolDatabase.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <climits>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The in-process interface of class-version: extracts the classes of the
+// sources of a compilation database into ToolDatabases, without spawning
+// the tool or going through its output. For example:
+//
+//   ExtractorOptions options;
+//   options.match_kind = MatchKind::Prefix;
+//   options.patterns = {"acme::wire::"};
+//   ClassExtractor extractor(options);
+//   std::string error;
+//   if (!extractor.init(error))
+//       ...
+//   ToolDatabase tdb;
+//   int result = extractor.run(Compilations, Sources, tdb);
+
+enum class TemplateMode
+{
+    Written,
+    Primary,
+    Explicit,
+    All
+};
+
+// What to extract and how; each member corresponds to an option of
+// class-version.
+struct ExtractorOptions
+{
+    // -m and --match-kind; no patterns match every class.
+    MatchKind match_kind = MatchKind::Substring;
+    std::vector<std::string> patterns;
+    // --templates
+    TemplateMode templates = TemplateMode::Written;
+    // --fast
+    bool skip_function_bodies = false;
+    // --layout
+    bool layout = false;
+    // --skip-system-headers
+    bool skip_system_headers = false;
+    // --skip-harvested-headers
+    bool skip_harvested_headers = false;
+    // --reuse-preamble
+    bool reuse_preamble = false;
+    // -j; 0 uses all cores.
+    unsigned jobs = 1;
+    // The expected cost of sources, such as their parse time in an earlier
+    // run. With jobs other than 1, sources are started costliest first, and
+    // those without a cost before all others, in source order.
+    llvm::StringMap<double> source_costs;
+    // With exact patterns only: stop starting sources once a definition of
+    // the class of every pattern has been found, and try the sources likeliest
+    // to define them first. Sources already being parsed still finish.
+    bool stop_when_found = false;
+    // Files known to define the classes of the patterns, such as their
+    // locations in an earlier output. Sources named like them, or in their
+    // directories, are tried first with stop_when_found.
+    std::vector<std::string> hint_files;
+};
+
+// Shared by all TUs of a run. For every class it remembers the first TU (in
+// source order) that declared it and the first that defined it, so a TU can
+// skip a class that an earlier TU records anyway; merging the per-TU
+// databases then yields exactly the entries of a serial run. The signature
+// of every definition is compared against the first one seen, and classes
+// whose definitions differ are remembered as ODR conflicts. Only what the
+// signature covers, the bases and fields, counts: inline function bodies
+// that differ with -D flags, say, do not change the layout.
+class ClassRegistry
+{
+  public:
+    // Returns true if TU `tu` has to record the class itself.
+    bool claim(llvm::StringRef usr, llvm::StringRef name, unsigned tu, bool is_definition,
+               uint64_t signature)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto inserted = m_entries.try_emplace(usr);
+        Entry &entry = inserted.first->second;
+        if (is_definition)
+        {
+            if (entry.def_tu == NoTU)
+            {
+                entry.signature = signature;
+            }
+            else if (entry.signature != signature)
+            {
+                flagODRConflict(usr, name);
+            }
+        }
+
+        unsigned &owner = is_definition ? entry.def_tu : entry.first_tu;
+        if (!inserted.second && tu > owner && owner != NoTU)
+        {
+            return false;
+        }
+        owner = std::min(owner, tu);
+        entry.first_tu = std::min(entry.first_tu, tu);
+        return true;
+    }
+
+    void reportODRConflict(llvm::StringRef usr, llvm::StringRef name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        flagODRConflict(usr, name);
+    }
+
+    bool isODRConflict(llvm::StringRef usr) const { return m_conflicts.count(usr) != 0; }
+
+  private:
+    static constexpr unsigned NoTU = UINT_MAX;
+
+    struct Entry
+    {
+        unsigned first_tu = NoTU;
+        unsigned def_tu = NoTU;
+        uint64_t signature = 0;
+    };
+
+    void flagODRConflict(llvm::StringRef usr, llvm::StringRef name)
+    {
+        if (m_conflicts.insert(usr).second)
+        {
+            llvm::errs() << "warning: ODR conflict: class " << name
+                         << " has different definitions in different translation units\n";
+        }
+    }
+
+    std::mutex m_mutex;
+    llvm::StringMap<Entry> m_entries;
+    llvm::StringSet<> m_conflicts;
+};
+
+// Remembers, across the run, the headers whose records have been harvested,
+// keyed by file identity plus content hash. As with ClassRegistry, a TU only
+// skips a header harvested by a TU earlier in source order, so that -j runs
+// skip exactly what a serial run would.
+class HeaderCache
+{
+  public:
+    typedef std::pair<llvm::sys::fs::UniqueID, uint64_t> Key;
+
+    bool harvestedBefore(const Key &key, unsigned tu)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_harvested.find(key);
+        return it != m_harvested.end() && it->second < tu;
+    }
+
+    void markHarvested(const Key &key, unsigned tu)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto inserted = m_harvested.try_emplace(key, tu);
+        inserted.first->second = std::min(inserted.first->second, tu);
+    }
+
+  private:
+    std::mutex m_mutex;
+    llvm::DenseMap<Key, unsigned> m_harvested;
+};
+
+// Counters of one TU, as class-version --stats reports them. Times are in
+// seconds; parsing is whatever part of the total was not spent traversing.
+struct TUStats
+{
+    double total = 0;
+    double traverse = 0;
+    unsigned records_visited = 0;
+    unsigned records_matched = 0;
+    unsigned fields = 0;
+    bool cached = false;
+    // False for a TU that a run with stop_when_found never started.
+    bool ran = false;
+    bool failed = false;
+};
+
+// Where the classes of one TU go: the database to fill, the registry shared
+// by the run, the header cache (null unless headers already harvested are
+// skipped) and the TU's position in the source list. If skip_claimed is
+// false, the TU records every class it sees even if an earlier TU records it
+// too, which is needed when its results are cached. If deps is set, it
+// collects the paths of all files the TU read. If stats is set, it is
+// updated with the counters of the TU.
+struct ExtractionTarget
+{
+    ToolDatabase &tdb;
+    ClassRegistry &registry;
+    HeaderCache *headers;
+    unsigned tu;
+    bool skip_claimed;
+    llvm::StringSet<> *deps;
+    TUStats *stats;
+};
+
+// Receives the database of every source, in source order.
+class ResultSink
+{
+  public:
+    virtual ~ResultSink() {}
+    virtual void consume(ToolDatabase &&tdb) = 0;
+    virtual void finish() {}
+};
+
+// Merges everything into one ToolDatabase, to be dumped at the end.
+class MergingSink : public ResultSink
+{
+  public:
+    explicit MergingSink(ToolDatabase &tdb) : m_tdb(tdb) {}
+
+    void consume(ToolDatabase &&tdb) override { m_tdb.merge(std::move(tdb)); }
+
+  private:
+    ToolDatabase &m_tdb;
+};
+
+// Hands every class to a callback once: as soon as the first TU that defines
+// it is consumed, or, for classes that are only ever declared, at finish().
+// Memory stays bounded by the set of USRs seen, but ODR conflicts found
+// after a class was handed out cannot be marked on it.
+class ClassStreamSink : public ResultSink
+{
+  public:
+    explicit ClassStreamSink(std::function<void(const ClassDatabase &)> callback)
+        : m_callback(std::move(callback))
+    {
+    }
+
+    void consume(ToolDatabase &&tdb) override
+    {
+        for (const ClassDatabase &cdb : tdb.classes())
+        {
+            if (cdb.usr_ref().empty())
+            {
+                m_callback(cdb);
+            }
+            else if (cdb.hasDefinition())
+            {
+                if (m_defined.insert(cdb.usr_ref()).second)
+                {
+                    m_callback(cdb);
+                }
+            }
+            else if (m_declared.findClass(cdb.usr_ref()) == nullptr)
+            {
+                ClassDatabase &declared = m_declared.addClass(cdb.name_ref(), cdb.usr_ref());
+                m_declared.setLocation(declared, cdb.file_ref(), cdb.line());
+            }
+        }
+    }
+
+    void finish() override
+    {
+        for (const ClassDatabase &cdb : m_declared.classes())
+        {
+            if (!m_defined.count(cdb.usr_ref()))
+            {
+                m_callback(cdb);
+            }
+        }
+    }
+
+  private:
+    std::function<void(const ClassDatabase &)> m_callback;
+    llvm::StringSet<> m_defined;
+    ToolDatabase m_declared;
+};
+
+class PreambleStore;
+
+// Runs the extraction over sources. One extractor is one run: its registry
+// and header cache are shared by all the TUs it extracts, and a TU's index
+// is its position in the source list.
+class ClassExtractor
+{
+  public:
+    explicit ClassExtractor(ExtractorOptions options);
+    virtual ~ClassExtractor();
+
+    // Compile the patterns; returns false, with error set, if one is
+    // invalid. Must be called before anything else.
+    bool init(std::string &error);
+
+    const ExtractorOptions &options() const { return m_options; }
+    const ClassMatcher &matcher() const { return m_matcher; }
+    ClassRegistry &registry() { return m_registry; }
+    HeaderCache &headerCache() { return m_headers; }
+
+    // Extract every source, up to options().jobs at a time, each into its
+    // own database, and hand the databases to sink in source order, each as
+    // soon as it and all before it are done. Sources started out of order,
+    // for source_costs or stop_when_found, wait for the earlier ones; to
+    // bound the memory, only a few of them per job are held at a time, and
+    // beyond that the first source not yet consumed goes next. Returns 0 on success, 1 if a TU
+    // failed and 2 if a file was skipped, like ClangTool::run.
+    //
+    // With stop_when_found, sources that were not started when the last
+    // class was found are handed over as empty databases. The classes are
+    // still those a run over the parsed sources alone would give: each is
+    // recorded from the first of them in source order, not the first parsed,
+    // and ODR conflicts are only detected among them.
+    int run(const clang::tooling::CompilationDatabase &Compilations,
+            const std::vector<std::string> &Sources, ResultSink &sink);
+
+    // The same, with all classes merged into tdb and ODR conflicts marked.
+    int run(const clang::tooling::CompilationDatabase &Compilations,
+            const std::vector<std::string> &Sources, ToolDatabase &tdb);
+
+    // The same, with every class handed to callback as ClassStreamSink does.
+    int run(const clang::tooling::CompilationDatabase &Compilations,
+            const std::vector<std::string> &Sources,
+            std::function<void(const ClassDatabase &)> callback);
+
+    // Extract one source into target, through file system FS. Sources named
+    // *.ast or *.pch are loaded as serialized ASTs instead of being parsed.
+    int extract(const clang::tooling::CompilationDatabase &Compilations,
+                const std::string &Source, const ExtractionTarget &target,
+                llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS) const;
+
+    // Whether extract() loads Source as a serialized AST.
+    static bool isASTFile(llvm::StringRef Source);
+
+    // A factory of actions that record into target, for callers that run a
+    // ClangTool of their own.
+    std::unique_ptr<clang::tooling::FrontendActionFactory>
+    newActionFactory(const ExtractionTarget &target) const;
+
+    // For callers that parse sources again and again: keep a precompiled
+    // preamble of the leading directives of every source that the factories
+    // parse, reused by later parses with the same directives and flags, and
+    // rebuilt once a file it covers changes.
+    void retainPreambles();
+
+  protected:
+    // Extract the tu-th source of a run into tdb. Called concurrently, from
+    // the worker threads of run().
+    virtual int extractSource(const clang::tooling::CompilationDatabase &Compilations,
+                              const std::string &Source, unsigned tu, ToolDatabase &tdb,
+                              llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS);
+
+  private:
+    int extractAST(const std::string &Source, const ExtractionTarget &target) const;
+
+    ExtractorOptions m_options;
+    ClassMatcher m_matcher;
+    ClassRegistry m_registry;
+    HeaderCache m_headers;
+    std::unique_ptr<PreambleStore> m_preambles;
+};
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef CLASS_SIGNATURE_CLASSMATCHER_H
+#define CLASS_SIGNATURE_CLASSMATCHER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/Regex.h"
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class MatchKind
+{
+    Substring,
+    Exact,
+    Prefix,
+    Glob,
+    Regex
+};
+
+// Matches qualified class names against the -m patterns, compiled once for
+// the run. Substring patterns become an Aho-Corasick automaton and prefix and
+// exact patterns a trie, so matching a name costs time linear in its length
+// however many patterns there are. Regexes are joined into one alternation;
+// globs are tried in turn.
+class ClassMatcher
+{
+  public:
+    bool compile(MatchKind kind, llvm::ArrayRef<std::string> patterns, std::string &error)
+    {
+        m_kind = kind;
+        m_empty = patterns.empty();
+        switch (kind)
+        {
+        case MatchKind::Substring:
+        case MatchKind::Exact:
+        case MatchKind::Prefix:
+            buildTrie(patterns);
+            if (kind == MatchKind::Substring)
+            {
+                buildAutomaton();
+            }
+            return true;
+        case MatchKind::Glob:
+            for (const std::string &pattern : patterns)
+            {
+                llvm::Expected<llvm::GlobPattern> glob = llvm::GlobPattern::create(pattern);
+                if (!glob)
+                {
+                    error = llvm::toString(glob.takeError());
+                    return false;
+                }
+                m_globs.push_back(std::move(*glob));
+            }
+            return true;
+        case MatchKind::Regex:
+        {
+            std::string alternation;
+            for (const std::string &pattern : patterns)
+            {
+                alternation += (alternation.empty() ? "(" : "|(") + pattern + ")";
+            }
+            m_regex.reset(new llvm::Regex(alternation));
+            return m_regex->isValid(error);
+        }
+        }
+        return true;
+    }
+
+    bool empty() const { return m_empty; }
+
+    bool matches(llvm::StringRef name) const
+    {
+        switch (m_kind)
+        {
+        case MatchKind::Substring:
+        {
+            int state = 0;
+            for (char c : name)
+            {
+                if (m_accept[state])
+                {
+                    return true;
+                }
+                state = next(state, c);
+            }
+            return m_accept[state];
+        }
+        case MatchKind::Prefix:
+        {
+            int state = 0;
+            for (char c : name)
+            {
+                if (m_accept[state])
+                {
+                    return true;
+                }
+                state = next(state, c);
+                if (state < 0)
+                {
+                    return false;
+                }
+            }
+            return m_accept[state];
+        }
+        case MatchKind::Exact:
+        {
+            int state = walk(name);
+            return state >= 0 && m_accept[state];
+        }
+        case MatchKind::Glob:
+            return std::any_of(m_globs.begin(), m_globs.end(),
+                               [&](const llvm::GlobPattern &glob) { return glob.match(name); });
+        case MatchKind::Regex:
+            return m_regex->match(name);
+        }
+        return false;
+    }
+
+    // Whether any class whose qualified name starts with scope, such as
+    // "acme::wire::", can match. Only prefix and exact patterns allow a
+    // scope to be ruled out.
+    bool canMatchWithin(llvm::StringRef scope) const
+    {
+        if (m_empty || (m_kind != MatchKind::Prefix && m_kind != MatchKind::Exact))
+        {
+            return true;
+        }
+        int state = 0;
+        for (char c : scope)
+        {
+            if (m_kind == MatchKind::Prefix && m_accept[state])
+            {
+                return true;
+            }
+            state = next(state, c);
+            if (state < 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    int next(int state, char c) const
+    {
+        return m_next[state * m_alphabet + m_char_class[static_cast<unsigned char>(c)]];
+    }
+
+    // Follow the trie along text; -1 if it leaves the trie.
+    int walk(llvm::StringRef text) const
+    {
+        int state = 0;
+        for (char c : text)
+        {
+            state = next(state, c);
+            if (state < 0)
+            {
+                break;
+            }
+        }
+        return state;
+    }
+
+    int addState()
+    {
+        m_next.resize(m_next.size() + m_alphabet, -1);
+        m_accept.push_back(false);
+        return static_cast<int>(m_accept.size()) - 1;
+    }
+
+    // Bytes are mapped to a compact alphabet of the characters that occur in
+    // the patterns; class 0 stands for every other byte.
+    void buildTrie(llvm::ArrayRef<std::string> patterns)
+    {
+        std::fill(std::begin(m_char_class), std::end(m_char_class), 0);
+        m_alphabet = 1;
+        for (const std::string &pattern : patterns)
+        {
+            for (char c : pattern)
+            {
+                uint8_t &cls = m_char_class[static_cast<unsigned char>(c)];
+                if (cls == 0)
+                {
+                    cls = m_alphabet++;
+                }
+            }
+        }
+
+        addState();
+        for (const std::string &pattern : patterns)
+        {
+            int state = 0;
+            for (char c : pattern)
+            {
+                size_t index = state * m_alphabet + m_char_class[static_cast<unsigned char>(c)];
+                if (m_next[index] < 0)
+                {
+                    // Not a reference: addState() may reallocate m_next.
+                    int added = addState();
+                    m_next[index] = added;
+                }
+                state = m_next[index];
+            }
+            m_accept[state] = true;
+        }
+    }
+
+    // Turn the trie into the Aho-Corasick automaton: a state accepts if any
+    // pattern ends there, and missing transitions follow failure links.
+    void buildAutomaton()
+    {
+        std::vector<int> fail(m_accept.size(), 0);
+        std::deque<int> queue;
+        for (unsigned cls = 0; cls < m_alphabet; ++cls)
+        {
+            int &target = m_next[cls];
+            if (target < 0)
+            {
+                target = 0;
+            }
+            else
+            {
+                queue.push_back(target);
+            }
+        }
+        while (!queue.empty())
+        {
+            int state = queue.front();
+            queue.pop_front();
+            m_accept[state] = m_accept[state] || m_accept[fail[state]];
+            for (unsigned cls = 0; cls < m_alphabet; ++cls)
+            {
+                int &target = m_next[state * m_alphabet + cls];
+                int fallback = m_next[fail[state] * m_alphabet + cls];
+                if (target < 0)
+                {
+                    target = fallback;
+                }
+                else
+                {
+                    fail[target] = fallback;
+                    queue.push_back(target);
+                }
+            }
+        }
+    }
+
+    MatchKind m_kind = MatchKind::Substring;
+    bool m_empty = true;
+    uint8_t m_char_class[256];
+    unsigned m_alphabet = 1;
+    std::vector<int> m_next;
+    std::vector<bool> m_accept;
+    std::vector<llvm::GlobPattern> m_globs;
+    std::unique_ptr<llvm::Regex> m_regex;
+};
+
+#endif
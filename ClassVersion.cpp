@@ -1,12 +1,44 @@
-#include "clang/AST/ASTConsumer.h"
-#include "clang/AST/Decl.h"
-#include "clang/AST/RecursiveASTVisitor.h"
-#include "clang/Frontend/CompilerInstance.h"
-#include "clang/Frontend/FrontendAction.h"
+#include "ClassExtractor.h"
+#include "SignatureDatabase.h"
+#include "ToolDatabase.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/Support/CommandLine.h"
-#include <fstream>
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <tuple>
+#ifdef LLVM_ON_UNIX
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 using namespace clang;
 using namespace clang::tooling;
@@ -29,220 +61,2259 @@ static llvm::cl::opt<std::string> OutputFilename("o", llvm::cl::desc("Specify ou
 
 static llvm::cl::list<std::string> matchList("m", llvm::cl::ZeroOrMore);
 
-template <class TargetType, class AppendType>
-void appendVal(TargetType &t, const AppendType &a, int num)
+static llvm::cl::opt<MatchKind> MatchMode(
+    "match-kind", llvm::cl::desc("How -m patterns are matched against qualified class names"),
+    llvm::cl::values(
+        clEnumValN(MatchKind::Substring, "substring", "The name contains the pattern (default)"),
+        clEnumValN(MatchKind::Exact, "exact", "The name is the pattern"),
+        clEnumValN(MatchKind::Prefix, "prefix", "The name starts with the pattern"),
+        clEnumValN(MatchKind::Glob, "glob", "The name matches the pattern as a glob"),
+        clEnumValN(MatchKind::Regex, "regex", "The name contains a match of the regex")),
+    llvm::cl::init(MatchKind::Substring), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> StopWhenFound(
+    "stop-when-found",
+    llvm::cl::desc("With --match-kind=exact, stop starting TUs once every -m class has been found "
+                   "defined, trying the TUs likeliest to define them first. The output has the "
+                   "classes of the TUs parsed, and ODR conflicts are only checked among them"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> Hints(
+    "hints",
+    llvm::cl::desc("With --stop-when-found, try the TUs named like, or next to, the files that "
+                   "define the -m classes in <file>, an earlier JSON output, first"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MyToolCategory));
+
+enum class OutputFormat
+{
+    JSON,
+    NDJSON,
+    Binary
+};
+
+static llvm::cl::opt<OutputFormat> Format(
+    "format", llvm::cl::desc("Output format"),
+    llvm::cl::values(clEnumValN(OutputFormat::JSON, "json",
+                                "One JSON array, written once all TUs are done (default)"),
+                     clEnumValN(OutputFormat::NDJSON, "ndjson",
+                                "One JSON object per class and line, written as TUs finish"),
+                     clEnumValN(OutputFormat::Binary, "binary",
+                                "A signature database with an index by class name")),
+    llvm::cl::init(OutputFormat::JSON), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<unsigned>
+    Jobs("j",
+         llvm::cl::desc("Number of translation units to parse, and of threads formatting the "
+                        "JSON output, concurrently (0 = all cores)"),
+         llvm::cl::value_desc("N"), llvm::cl::init(1), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<unsigned> MemoryBudget(
+    "memory-budget",
+    llvm::cl::desc("Keep at most about this many MiB of merged classes in memory; beyond that, "
+                   "spill them to temporary files and merge those at the end (0 = no limit)"),
+    llvm::cl::value_desc("MiB"), llvm::cl::init(0), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> SkipHarvestedHeaders(
+    "skip-harvested-headers",
+    llvm::cl::desc("Do not traverse declarations in headers that an earlier translation unit "
+                   "already harvested. Assumes a header expands the same way in every TU."),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool>
+    FastParse("fast",
+              llvm::cl::desc("Skip function bodies while parsing and only record classes at their "
+                             "definition. Classes that are only declared, or only defined or "
+                             "instantiated inside function bodies, are not reported."),
+              llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> CacheDir(
+    "cache-dir",
+    llvm::cl::desc("Directory for caching the classes extracted from each source file. Sources "
+                   "whose compile command and included files are unchanged are not parsed "
+                   "again. Implies that --skip-harvested-headers is ignored."),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> ReusePreamble(
+    "reuse-preamble",
+    llvm::cl::desc("Precompile the leading preprocessor directives that several sources share "
+                   "once, and reuse them in every TU with the same prefix and compiler flags"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool>
+    SkipSystemHeaders("skip-system-headers",
+                      llvm::cl::desc("Do not traverse declarations located in system headers"),
+                      llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> DedupCommands(
+    "dedup-commands",
+    llvm::cl::desc("Parse a source only once per distinct set of compile flags: drop repeated "
+                   "sources, and merge compile commands that differ only in flags that do not "
+                   "change what the source declares, such as warnings, debug info, dependency "
+                   "files and the output"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> Layout(
+    "layout",
+    llvm::cl::desc("Also write the record layout of each class: its size, alignment and padding, "
+                   "whether it is trivially copyable or standard-layout, and the offset and "
+                   "size of each field"),
+    llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<TemplateMode> Templates(
+    "templates",
+    llvm::cl::desc("Which class templates and specializations to record; other classes are "
+                   "always recorded"),
+    llvm::cl::values(
+        clEnumValN(TemplateMode::Written, "written",
+                   "Primary templates and the explicit specializations and instantiations in "
+                   "the source (default)"),
+        clEnumValN(TemplateMode::Primary, "primary",
+                   "Only primary and partially specialized templates, named with their "
+                   "parameters"),
+        clEnumValN(TemplateMode::Explicit, "explicit",
+                   "Only explicit specializations and instantiations"),
+        clEnumValN(TemplateMode::All, "all",
+                   "Every specialization the TU defines, implicit instantiations included; "
+                   "each argument list is recorded once")),
+    llvm::cl::init(TemplateMode::Written), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> Baseline(
+    "baseline",
+    llvm::cl::desc("Compare the classes found against a signature database written earlier with "
+                   "--format=binary. Instead of the classes, the added, removed and changed ones "
+                   "are written, and the exit code is non-zero if any class was removed or "
+                   "changed."),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> Serve(
+    "serve",
+    llvm::cl::desc("Stay resident and answer requests on a Unix domain socket. Each connection "
+                   "sends one line, a source file optionally followed by a tab and a class name, "
+                   "and receives the classes of that source, or just the named one, as a line "
+                   "of JSON. Results are kept until a file they depend on changes. The sources "
+                   "on the command line are parsed up front; a line \"quit\" stops the server."),
+    llvm::cl::value_desc("socket"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> Shard(
+    "shard",
+    llvm::cl::desc("Only process the i-th of N parts of the sources, balanced by file size, and "
+                   "write them in a form that \"class-version merge\" combines, given all N "
+                   "parts, into the output of a run over all sources"),
+    llvm::cl::value_desc("i/N"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> DepFile(
+    "depfile",
+    llvm::cl::desc("Also write a Makefile-style depfile to <file>, with the -o output depending "
+                   "on every file that defines or declares a class written, or defines a "
+                   "class, typedef or enumeration that its signature covers"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool> Compact("compact",
+                                   llvm::cl::desc("Write JSON output without any whitespace"),
+                                   llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<bool>
+    Stats("stats",
+          llvm::cl::desc("Print the time spent on every TU, the number of records visited, "
+                         "matched and fields written, and the size of the output to stderr"),
+          llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> CostFile(
+    "cost-file",
+    llvm::cl::desc("With -j, start the sources that took longest in earlier runs first, going by "
+                   "the parse times in <file>, and store the times of this run in it"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<std::string> TimeTrace(
+    "time-trace",
+    llvm::cl::desc("Write a Chrome trace of the run, including the events of the compiler, "
+                   "to <file>"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MyToolCategory));
+
+static llvm::cl::opt<unsigned> TimeTraceGranularity(
+    "time-trace-granularity",
+    llvm::cl::desc("Minimum duration in microseconds of the events in the --time-trace"),
+    llvm::cl::init(500), llvm::cl::cat(MyToolCategory));
+
+// Output streams are given a large buffer so that they are written in few,
+// large blocks.
+static const size_t OutputBufferSize = 1 << 20;
+
+// Version of the complete encoding below, as used by cache entries and
+// shard outputs.
+static constexpr int64_t DatabaseFormatVersion = 9;
+
+// The complete encoding of a class. Unlike the JSON output, it keeps what
+// merging databases again needs: USRs, and which classes were defined.
+static llvm::json::Object class_to_json(const ClassDatabase &cdb)
 {
-    for (int i = 0; i < num; ++i)
+    llvm::json::Array field_array;
+    for (const FieldDatabase &fdb : cdb.fields())
     {
-        t += a;
+        field_array.push_back(llvm::json::Object{{"type", fdb.type},
+                                                 {"variable", fdb.variable},
+                                                 {"offset", int64_t(fdb.offset)},
+                                                 {"size", int64_t(fdb.size)}});
+    }
+    llvm::json::Object cls{{"name", cdb.name_ref()},
+                           {"usr", cdb.usr_ref()},
+                           {"file", cdb.file_ref()},
+                           {"line", int64_t(cdb.line())},
+                           {"definition", cdb.hasDefinition()},
+                           {"signature", int64_t(cdb.signature())},
+                           {"signature_files", llvm::json::Array(cdb.signature_files())},
+                           {"odr_conflict", cdb.odrConflict()},
+                           {"fields", std::move(field_array)}};
+    if (const llvm::Optional<RecordLayout> &layout = cdb.layout())
+    {
+        llvm::json::Array padding;
+        for (const auto &hole : layout->padding)
+        {
+            padding.push_back(llvm::json::Array{int64_t(hole.first), int64_t(hole.second)});
+        }
+        cls["layout"] = llvm::json::Object{{"size", int64_t(layout->size)},
+                                           {"alignment", int64_t(layout->alignment)},
+                                           {"trivially_copyable", layout->trivially_copyable},
+                                           {"standard_layout", layout->standard_layout},
+                                           {"padding", std::move(padding)}};
     }
+    return cls;
 }
 
-struct FieldDatabase
+static llvm::json::Array database_to_json(const ToolDatabase &tdb)
 {
-    std::string type;
-    std::string variable;
-
-    template <class OstreamType> OstreamType &dump(OstreamType &out, int indent = 0) const
+    llvm::json::Array class_array;
+    for (const ClassDatabase &cdb : tdb.classes())
     {
-        std::string indent_str;
-        std::string member_indent_str;
-        appendVal(indent_str, " ", indent);
-        appendVal(member_indent_str, " ", indent + 4);
-        out << indent_str << "{\n";
-        out << member_indent_str << "\"type\" : \"" << type << "\",\n";
-        out << member_indent_str << "\"variable\": \"" << variable << "\"";
-        out << "\n" << indent_str << "}";
-        return out;
+        class_array.push_back(class_to_json(cdb));
     }
-};
+    return class_array;
+}
 
-class ClassDatabase
+// Append a class in the complete encoding to tdb. Returns null if the
+// encoding is malformed.
+static ClassDatabase *class_from_json(const llvm::json::Value &value, ToolDatabase &tdb)
 {
-  public:
-    ClassDatabase(std::string &&name) : m_name(name) {}
-    FieldDatabase &addField()
+    const llvm::json::Object *cls = value.getAsObject();
+    if (cls == nullptr)
     {
-        m_fields.emplace_back(FieldDatabase());
-        return m_fields.back();
+        return nullptr;
     }
-
-    const std::string &name_ref() const { return m_name; }
-
-    std::string name() const { return m_name; }
-
-    template <class OstreamType> OstreamType &dump(OstreamType &out, int indent = 0) const
+    ClassDatabase &cdb = tdb.addClass(cls->getString("name").getValueOr(""),
+                                      cls->getString("usr").getValueOr(""));
+    tdb.setLocation(cdb, cls->getString("file").getValueOr(""),
+                    cls->getInteger("line").getValueOr(0));
+    if (cls->getBoolean("definition").getValueOr(false))
+    {
+        cdb.setDefinition(cls->getInteger("signature").getValueOr(0));
+    }
+    if (const llvm::json::Array *files = cls->getArray("signature_files"))
     {
-        std::string indent_str;
-        std::string member_indent_str;
-        appendVal(indent_str, " ", indent);
-        appendVal(member_indent_str, " ", indent + 4);
-        out << indent_str << "{\n";
-        out << member_indent_str << "\"name\": \"" << m_name << "\",\n";
-        if (m_fields.empty())
+        std::vector<llvm::StringRef> paths;
+        for (const llvm::json::Value &file : *files)
         {
-            out << member_indent_str << "\"fields\": []";
+            paths.push_back(file.getAsString().getValueOr(""));
         }
-        else
+        tdb.setSignatureFiles(cdb, paths);
+    }
+    if (const llvm::json::Object *layout = cls->getObject("layout"))
+    {
+        RecordLayout rl;
+        rl.size = layout->getInteger("size").getValueOr(0);
+        rl.alignment = layout->getInteger("alignment").getValueOr(0);
+        rl.trivially_copyable = layout->getBoolean("trivially_copyable").getValueOr(false);
+        rl.standard_layout = layout->getBoolean("standard_layout").getValueOr(false);
+        if (const llvm::json::Array *padding = layout->getArray("padding"))
         {
-            out << member_indent_str << "\"fields\":\n";
-            out << member_indent_str << "[\n";
-            int iter = 0;
-            for (const FieldDatabase &fdb : m_fields)
+            for (const llvm::json::Value &hole : *padding)
             {
-                if (iter > 0)
+                const llvm::json::Array *range = hole.getAsArray();
+                if (range == nullptr || range->size() != 2)
                 {
-                    out << ",\n";
+                    return nullptr;
                 }
-                iter++;
-                fdb.dump(out, indent + 8);
+                rl.padding.emplace_back((*range)[0].getAsInteger().getValueOr(0),
+                                        (*range)[1].getAsInteger().getValueOr(0));
+            }
+        }
+        cdb.setLayout(std::move(rl));
+    }
+    if (cls->getBoolean("odr_conflict").getValueOr(false))
+    {
+        cdb.setODRConflict();
+    }
+    if (const llvm::json::Array *fields = cls->getArray("fields"))
+    {
+        llvm::MutableArrayRef<FieldDatabase> fdbs = tdb.setFields(cdb, fields->size());
+        for (size_t i = 0; i < fields->size(); ++i)
+        {
+            const llvm::json::Object *fld = (*fields)[i].getAsObject();
+            if (fld == nullptr)
+            {
+                return nullptr;
             }
-            out << "\n" << member_indent_str << "]";
+            FieldDatabase &fdb = fdbs[i];
+            fdb.type = tdb.intern(fld->getString("type").getValueOr(""));
+            fdb.variable = tdb.intern(fld->getString("variable").getValueOr(""));
+            fdb.offset = fld->getInteger("offset").getValueOr(0);
+            fdb.size = fld->getInteger("size").getValueOr(0);
         }
-        out << "\n" << indent_str << "}";
-        return out;
     }
+    return &cdb;
+}
 
-  private:
-    std::vector<FieldDatabase> m_fields;
-    std::string m_name;
-};
+// Append the classes of a complete encoding to tdb. Returns false if the
+// encoding is malformed.
+static bool database_from_json(const llvm::json::Array &classes, ToolDatabase &tdb)
+{
+    for (const llvm::json::Value &value : classes)
+    {
+        if (class_from_json(value, tdb) == nullptr)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Write the file at path through a temporary, named after model as for
+// createUniqueFile, that is renamed into place, so that concurrent runs never
+// read a partial file.
+static std::error_code write_file_atomically(const llvm::Twine &path, const llvm::Twine &model,
+                                             llvm::function_ref<void(llvm::raw_ostream &)> write)
+{
+    int fd;
+    llvm::SmallString<128> tmp_path;
+    std::error_code ec = llvm::sys::fs::createUniqueFile(model, fd, tmp_path);
+    if (ec)
+    {
+        return ec;
+    }
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        write(out);
+        out.close();
+        ec = out.error();
+    }
+    if (!ec)
+    {
+        ec = llvm::sys::fs::rename(tmp_path, path);
+    }
+    if (ec)
+    {
+        llvm::sys::fs::remove(tmp_path);
+    }
+    return ec;
+}
 
-class ToolDatabase
+// On-disk cache for --cache-dir. Each source file has one entry, named by a
+// hash of its path, its compile commands and the options that affect
+// extraction. An entry lists every file the source's TUs read, with a hash
+// of its contents, and the classes they produced. It is only used if all of
+// those files still have the same contents.
+class SignatureCache
 {
   public:
-    ClassDatabase &addClass(std::string &&name)
+    explicit SignatureCache(llvm::StringRef dir) : m_dir(dir.str()) {}
+
+    static std::string key(llvm::StringRef source, const std::vector<CompileCommand> &commands)
+    {
+        std::string config;
+        llvm::raw_string_ostream os(config);
+        os << DatabaseFormatVersion << '\0' << source << '\0' << FastParse << SkipSystemHeaders
+           << Layout << static_cast<int>(MatchMode.getValue())
+           << static_cast<int>(Templates.getValue()) << '\0';
+        for (const std::string &m : matchList)
+        {
+            os << m << '\0';
+        }
+        for (const CompileCommand &command : commands)
+        {
+            os << command.Directory << '\0' << command.Filename << '\0';
+            for (const std::string &arg : command.CommandLine)
+            {
+                os << arg << '\0';
+            }
+        }
+        return llvm::utohexstr(llvm::xxHash64(os.str()));
+    }
+
+    // Fill tdb from the entry for key if it is still valid.
+    bool load(llvm::StringRef key, ToolDatabase &tdb) const
     {
-        m_classes.emplace_back(ClassDatabase(std::forward<std::string>(name)));
-        return m_classes.back();
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+            llvm::MemoryBuffer::getFile(entryPath(key));
+        if (!buffer)
+        {
+            return false;
+        }
+        llvm::Expected<llvm::json::Value> root = llvm::json::parse(buffer.get()->getBuffer());
+        if (!root)
+        {
+            llvm::consumeError(root.takeError());
+            return false;
+        }
+        const llvm::json::Object *entry = root->getAsObject();
+        if (entry == nullptr || entry->getInteger("version") != DatabaseFormatVersion)
+        {
+            return false;
+        }
+
+        const llvm::json::Array *deps = entry->getArray("deps");
+        const llvm::json::Array *classes = entry->getArray("classes");
+        if (deps == nullptr || classes == nullptr)
+        {
+            return false;
+        }
+        for (const llvm::json::Value &dep : *deps)
+        {
+            const llvm::json::Object *file = dep.getAsObject();
+            llvm::Optional<llvm::StringRef> path = file ? file->getString("path") : llvm::None;
+            llvm::Optional<llvm::StringRef> hash = file ? file->getString("hash") : llvm::None;
+            if (!path || !hash || contentHash(*path) != *hash)
+            {
+                return false;
+            }
+        }
+
+        ToolDatabase cached;
+        if (!database_from_json(*classes, cached))
+        {
+            return false;
+        }
+        tdb.merge(std::move(cached));
+        return true;
     }
 
-    template <class OstreamType> OstreamType &dump(OstreamType &out, int indent = 0) const
+    // Write the entry for key. Failures only cost a re-parse next time, so
+    // they are reported but not fatal.
+    void store(llvm::StringRef key, const ToolDatabase &tdb, const llvm::StringSet<> &deps) const
     {
-        std::string indent_str;
-        appendVal(indent_str, " ", indent);
-        out << "\n" << indent_str << "[\n";
-        int iter = 0;
-        for (const auto &cdb : m_classes)
+        llvm::json::Array dep_array;
+        for (const auto &dep : deps)
         {
-            if (iter > 0)
+            std::string hash = contentHash(dep.getKey());
+            if (hash.empty())
             {
-                out << ",\n";
+                return;
             }
-            iter++;
-            cdb.dump(out, indent + 4);
+            dep_array.push_back(llvm::json::Object{{"path", dep.getKey()}, {"hash", hash}});
+        }
+
+        llvm::json::Object entry{{"version", DatabaseFormatVersion},
+                                 {"deps", std::move(dep_array)},
+                                 {"classes", database_to_json(tdb)}};
+        std::error_code ec = write_file_atomically(
+            entryPath(key), m_dir + "/%%%%%%%%.tmp",
+            [&](llvm::raw_ostream &out) { out << llvm::json::Value(std::move(entry)); });
+        if (ec)
+        {
+            llvm::errs() << "warning: failed to write cache entry to " << m_dir << ": "
+                         << ec.message() << "\n";
         }
-        out << "\n" << indent_str << "]";
-        return out;
     }
 
   private:
-    std::vector<ClassDatabase> m_classes;
+    std::string entryPath(llvm::StringRef key) const { return m_dir + "/" + key.str() + ".json"; }
+
+    // Hex hash of a file's contents, or "" if it cannot be read.
+    static std::string contentHash(llvm::StringRef path)
+    {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+            llvm::MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!buffer)
+        {
+            return std::string();
+        }
+        return llvm::utohexstr(llvm::xxHash64(buffer.get()->getBuffer()));
+    }
+
+    std::string m_dir;
 };
 
 ToolDatabase global_tdb;
+std::unique_ptr<SignatureCache> global_cache;
 
-class FindNamedClassVisitor : public RecursiveASTVisitor<FindNamedClassVisitor>
+// What --stats reports for the run; tus is indexed like the sources.
+struct RunStats
 {
-  private:
-    bool shouldVisit(CXXRecordDecl *Declaration)
+    std::vector<std::string> sources;
+    std::vector<TUStats> tus;
+    uint64_t output_bytes = 0;
+    double output_time = 0;
+};
+RunStats global_stats;
+
+// The extractor of the run, created by create_extractor().
+std::unique_ptr<ClassExtractor> global_extractor;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Merges like MergingSink until the database outgrows --memory-budget, then
+// spills its classes to a temporary run file, sorted by USR, and starts over
+// with an empty one. finish() combines the runs with a k-way merge: a USR
+// keeps the position of its first occurrence and its first definition, as
+// ToolDatabase::merge() does. The result goes to one more file, and
+// forEachClass() reads it back in output order, so that only a position and
+// a file offset per class stay in memory. Nothing is spilled while the
+// budget holds, and the database then has every class, as with MergingSink.
+class SpillingSink : public ResultSink
+{
+  public:
+    SpillingSink(ToolDatabase &tdb, size_t budget) : m_tdb(tdb), m_budget(budget) {}
+
+    ~SpillingSink() override
     {
-        if (matchList.empty())
+        for (const std::string &path : m_runs)
         {
-            // No matching list specified. Visit everything
-            return true;
+            llvm::sys::fs::remove(path);
+        }
+        if (!m_merged_path.empty())
+        {
+            llvm::sys::fs::remove(m_merged_path);
+        }
+    }
+
+    void consume(ToolDatabase &&tdb) override
+    {
+        m_tdb.merge(std::move(tdb));
+        if (m_tdb.memoryUsage() > m_budget)
+        {
+            spill();
+        }
+    }
+
+    void finish() override
+    {
+        if (!m_runs.empty())
+        {
+            spill();
+            mergeRuns();
         }
+    }
 
-        std::string class_name = Declaration->getQualifiedNameAsString();
+    bool spilled() const { return !m_runs.empty(); }
+    bool failed() const { return m_failed; }
 
-        for (const auto &m : matchList)
+    // Hand out the merged classes in output order, with their ODR conflicts
+    // marked. Each is decoded into a database of its own and dropped after
+    // the callback.
+    void forEachClass(const ClassRegistry &registry,
+                      llvm::function_ref<void(const ClassDatabase &)> callback)
+    {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(
+            m_merged_path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!buffer)
+        {
+            fail(m_merged_path, buffer.getError().message());
+            return;
+        }
+        llvm::StringRef data = buffer.get()->getBuffer();
+        for (const auto &entry : m_order)
         {
-            if (class_name.find(m) != std::string::npos)
+            llvm::Expected<llvm::json::Value> value =
+                llvm::json::parse(data.substr(entry.second).take_until([](char c) {
+                    return c == '\n';
+                }));
+            ToolDatabase tdb;
+            ClassDatabase *cdb = value ? class_from_json(*value, tdb) : nullptr;
+            if (cdb == nullptr)
+            {
+                llvm::consumeError(value.takeError());
+                fail(m_merged_path, "malformed class");
+                return;
+            }
+            if (registry.isODRConflict(cdb->usr_ref()))
             {
-                return true;
+                cdb->setODRConflict();
             }
+            callback(*cdb);
         }
-
-        return false;
     }
 
-  public:
-    explicit FindNamedClassVisitor(ASTContext *Context) : Context(Context) {}
+  private:
+    // A class of a run: its position in the output, its identity, whether it
+    // is a definition, and its line of the run file.
+    struct Record
+    {
+        int64_t position = 0;
+        std::string usr;
+        bool definition = false;
+        llvm::StringRef line;
+    };
+
+    void fail(llvm::StringRef path, llvm::StringRef message)
+    {
+        llvm::errs() << "Failed to spill classes to " << path << ": " << message << "\n";
+        m_failed = true;
+    }
 
-    bool VisitCXXRecordDecl(CXXRecordDecl *Declaration)
+    // Write the database as one more run, one class per line.
+    void spill()
     {
-        if (!shouldVisit(Declaration))
+        const std::vector<ClassDatabase> &classes = m_tdb.classes();
+        if (classes.empty() || m_failed)
         {
-            return true;
+            return;
+        }
+        std::vector<size_t> order(classes.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+            return classes[lhs].usr_ref() < classes[rhs].usr_ref();
+        });
+
+        int fd;
+        llvm::SmallString<256> path;
+        if (std::error_code ec =
+                llvm::sys::fs::createTemporaryFile("class-version-run", "ndjson", fd, path))
+        {
+            fail(path, ec.message());
+            return;
+        }
+        m_runs.push_back(std::string(path.str()));
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out.SetBufferSize(OutputBufferSize);
+        for (size_t i : order)
+        {
+            out << llvm::json::Value(llvm::json::Object{{"position", m_next_position + int64_t(i)},
+                                                        {"class", class_to_json(classes[i])}})
+                << '\n';
+        }
+        out.close();
+        if (out.has_error())
+        {
+            fail(path, out.error().message());
+            out.clear_error();
         }
-        ClassDatabase &cdb = global_tdb.addClass(Declaration->getQualifiedNameAsString());
-        for (const FieldDecl *fdcl : Declaration->fields())
+        m_next_position += classes.size();
+        m_tdb = ToolDatabase();
+    }
+
+    bool parse(llvm::StringRef line, Record &record)
+    {
+        llvm::Expected<llvm::json::Value> value = llvm::json::parse(line);
+        const llvm::json::Object *object = value ? value->getAsObject() : nullptr;
+        const llvm::json::Object *cls = object ? object->getObject("class") : nullptr;
+        if (cls == nullptr)
         {
-            FieldDatabase &fdb = cdb.addField();
-            fdb.type = fdcl->getType().getAsString();
-            fdb.variable = fdcl->getQualifiedNameAsString();
+            llvm::consumeError(value.takeError());
+            return false;
         }
+        record.position = object->getInteger("position").getValueOr(0);
+        record.usr = cls->getString("usr").getValueOr("").str();
+        record.definition = cls->getBoolean("definition").getValueOr(false);
+        record.line = line;
         return true;
     }
 
-  private:
-    ASTContext *Context;
+    void mergeRuns()
+    {
+        if (m_failed)
+        {
+            return;
+        }
+        std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+        std::vector<llvm::line_iterator> lines;
+        std::vector<Record> heads(m_runs.size());
+        for (const std::string &path : m_runs)
+        {
+            llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(
+                path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+            if (!buffer)
+            {
+                fail(path, buffer.getError().message());
+                return;
+            }
+            buffers.push_back(std::move(*buffer));
+            lines.emplace_back(*buffers.back());
+        }
+
+        // Runs ordered by the USR of their current class, and by position
+        // among equal USRs. Classes without a USR are never merged.
+        auto later = [&](size_t lhs, size_t rhs) {
+            return std::tie(heads[lhs].usr, heads[lhs].position) >
+                   std::tie(heads[rhs].usr, heads[rhs].position);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> queue(later);
+        auto advance = [&](size_t run) {
+            if (lines[run].is_at_eof())
+            {
+                return;
+            }
+            if (!parse(*lines[run], heads[run]))
+            {
+                fail(m_runs[run], "malformed run");
+                return;
+            }
+            ++lines[run];
+            queue.push(run);
+        };
+        for (size_t run = 0; run < m_runs.size(); ++run)
+        {
+            advance(run);
+        }
+
+        int fd;
+        llvm::SmallString<256> path;
+        if (std::error_code ec =
+                llvm::sys::fs::createTemporaryFile("class-version-merged", "ndjson", fd, path))
+        {
+            fail(path, ec.message());
+            return;
+        }
+        m_merged_path = std::string(path.str());
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out.SetBufferSize(OutputBufferSize);
+        while (!queue.empty() && !m_failed)
+        {
+            size_t run = queue.top();
+            queue.pop();
+            Record first = heads[run];
+            Record chosen = first;
+            advance(run);
+            while (!first.usr.empty() && !queue.empty() && heads[queue.top()].usr == first.usr)
+            {
+                run = queue.top();
+                queue.pop();
+                if (!chosen.definition && heads[run].definition)
+                {
+                    chosen = heads[run];
+                }
+                advance(run);
+            }
+            // The line was parsed once already.
+            llvm::Expected<llvm::json::Value> value = llvm::json::parse(chosen.line);
+            if (!value)
+            {
+                llvm::consumeError(value.takeError());
+                fail(m_runs[run], "malformed run");
+                break;
+            }
+            m_order.emplace_back(first.position, out.tell());
+            out << *value->getAsObject()->get("class") << '\n';
+        }
+        out.close();
+        if (out.has_error())
+        {
+            fail(path, out.error().message());
+            out.clear_error();
+        }
+        std::sort(m_order.begin(), m_order.end());
+    }
+
+    ToolDatabase &m_tdb;
+    size_t m_budget;
+    bool m_failed = false;
+    int64_t m_next_position = 0;
+    std::vector<std::string> m_runs;
+    std::string m_merged_path;
+    // Output position and offset in the merged file of every class.
+    std::vector<std::pair<int64_t, uint64_t>> m_order;
 };
 
-class FindNamedClassConsumer : public clang::ASTConsumer
+// Set by write_output() with --memory-budget.
+std::unique_ptr<SpillingSink> global_spill;
+
+// The classes to write, in output order: those of global_tdb, or those that
+// global_spill read back if it had to spill.
+static void for_each_class(llvm::function_ref<void(const ClassDatabase &)> callback)
 {
-  public:
-    explicit FindNamedClassConsumer(ASTContext *Context) : Visitor(Context) {}
+    if (global_spill && global_spill->spilled())
+    {
+        global_spill->forEachClass(global_extractor->registry(), callback);
+        return;
+    }
+    for (const ClassDatabase &cdb : global_tdb.classes())
+    {
+        callback(cdb);
+    }
+}
+
+// Classes formatted by one task of write_classes().
+static const size_t OutputChunkClasses = 256;
 
-    virtual void HandleTranslationUnit(clang::ASTContext &Context)
+// Write the classes in output order with format, which writes a run of
+// consecutive classes given the position of its first one. With -j, runs of
+// global_tdb are formatted in parallel into buffers that are written out in
+// order, each in one block, so the output is the same as a serial one; only
+// a window of a few runs per thread is buffered at a time. Classes read back
+// by global_spill come one at a time and are formatted serially.
+static void write_classes(
+    llvm::raw_ostream &out,
+    llvm::function_ref<void(llvm::raw_ostream &, llvm::ArrayRef<ClassDatabase>, size_t)> format)
+{
+    if (global_spill && global_spill->spilled())
+    {
+        size_t index = 0;
+        for_each_class([&](const ClassDatabase &cdb) { format(out, cdb, index++); });
+        return;
+    }
+    llvm::ArrayRef<ClassDatabase> classes = global_tdb.classes();
+    llvm::ThreadPoolStrategy strategy = llvm::hardware_concurrency(Jobs);
+    size_t window = 2 * strategy.compute_thread_count();
+    size_t runs = (classes.size() + OutputChunkClasses - 1) / OutputChunkClasses;
+    if (window <= 2 || runs <= 1)
     {
-        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+        format(out, classes, 0);
+        return;
     }
 
-  private:
-    FindNamedClassVisitor Visitor;
-};
+    llvm::ThreadPool Pool(strategy);
+    std::vector<std::string> buffers(window);
+    std::vector<std::shared_future<void>> pending(window);
+    auto start = [&](size_t run) {
+        pending[run % window] = Pool.async([&, run]() {
+            size_t first = run * OutputChunkClasses;
+            llvm::raw_string_ostream os(buffers[run % window]);
+            format(os, classes.slice(first, std::min(OutputChunkClasses, classes.size() - first)),
+                   first);
+        });
+    };
+    for (size_t run = 0; run < std::min(window, runs); ++run)
+    {
+        start(run);
+    }
+    for (size_t run = 0; run < runs; ++run)
+    {
+        std::string &buffer = buffers[run % window];
+        pending[run % window].wait();
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+        if (run + window < runs)
+        {
+            start(run + window);
+        }
+    }
+}
 
-class FindNamedClassAction : public clang::ASTFrontendAction
+// Writes each class as one line of JSON as soon as the first TU that defines
+// it is consumed, so memory stays bounded by the set of USRs seen. Classes
+// that are only ever declared are written by finish(). ODR conflicts are
+// still reported on stderr, but cannot be marked on lines already written.
+class NDJSONSink : public ClassStreamSink
 {
   public:
-    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler,
-                                                                  llvm::StringRef InFile)
+    explicit NDJSONSink(llvm::raw_ostream &out)
+        : ClassStreamSink([&out](const ClassDatabase &cdb) {
+              JSONWriter writer(out, /*compact=*/true);
+              cdb.write(writer);
+              out << '\n';
+          }),
+          m_out(out)
+    {
+    }
+
+    void consume(ToolDatabase &&tdb) override
+    {
+        ClassStreamSink::consume(std::move(tdb));
+        m_out.flush();
+    }
+
+    void finish() override
     {
-        return std::unique_ptr<clang::ASTConsumer>(
-            new FindNamedClassConsumer(&Compiler.getASTContext()));
+        ClassStreamSink::finish();
+        m_out.flush();
     }
+
+  private:
+    llvm::raw_ostream &m_out;
 };
 
-int dump_tool_database()
+// Notes the files of the classes of every database it is handed, for
+// --depfile, before passing the database on: where each class is, and what
+// its signature depends on.
+class DepFileSink : public ResultSink
 {
-    if (OutputFilename == "-")
+  public:
+    explicit DepFileSink(ResultSink &next) : m_next(next) {}
+
+    void consume(ToolDatabase &&tdb) override
     {
-        global_tdb.dump(llvm::outs());
-        llvm::outs() << "\n";
-        return 0;
+        for (const ClassDatabase &cdb : tdb.classes())
+        {
+            if (!cdb.file_ref().empty())
+            {
+                m_files.insert(cdb.file_ref());
+            }
+            for (llvm::StringRef file : cdb.signature_files())
+            {
+                m_files.insert(file);
+            }
+        }
+        m_next.consume(std::move(tdb));
     }
 
-    std::ofstream out(OutputFilename.c_str());
-    if (out.fail() || out.bad())
+    void finish() override { m_next.finish(); }
+
+    // Write a Makefile rule making target depend on the files, in sorted
+    // order so that the depfile is stable.
+    bool write(llvm::StringRef path, llvm::StringRef target) const
     {
-        llvm::errs() << "Failed to open output file " << OutputFilename << " for writing.";
-        return 1;
+        std::vector<llvm::StringRef> files;
+        for (const auto &file : m_files)
+        {
+            files.push_back(file.getKey());
+        }
+        llvm::sort(files);
+
+        std::error_code ec;
+        llvm::raw_fd_ostream out(path, ec);
+        if (ec)
+        {
+            llvm::errs() << "Failed to open depfile " << path << " for writing.";
+            return false;
+        }
+        writeEscaped(out, target);
+        out << ':';
+        for (llvm::StringRef file : files)
+        {
+            out << " \\\n  ";
+            writeEscaped(out, file);
+        }
+        out << '\n';
+        out.close();
+        if (out.has_error())
+        {
+            llvm::errs() << "Failed to write depfile " << path << ": " << out.error().message()
+                         << "\n";
+            out.clear_error();
+            return false;
+        }
+        return true;
     }
 
-    global_tdb.dump(out);
+  private:
+    // Escape a path as Make and Ninja read it, like clang's -MF output.
+    static void writeEscaped(llvm::raw_ostream &out, llvm::StringRef path)
+    {
+        for (char c : path)
+        {
+            if (c == ' ' || c == '#')
+            {
+                out << '\\';
+            }
+            else if (c == '$')
+            {
+                out << '$';
+            }
+            out << c;
+        }
+    }
 
-    return 0;
-}
+    ResultSink &m_next;
+    llvm::StringSet<> m_files;
+};
 
-int main(int argc, const char **argv)
+// The compile commands of another database with those of each source that
+// preprocess alike merged into one, for --dedup-commands. Commands are
+// compared by their arguments, with paths made absolute and arguments that
+// do not change the TU left out.
+class DedupCompilationDatabase : public CompilationDatabase
 {
-    CommonOptionsParser OptionsParser(argc, argv, MyToolCategory);
-    ClangTool Tool(OptionsParser.getCompilations(), OptionsParser.getSourcePathList());
-    int result = Tool.run(newFrontendActionFactory<FindNamedClassAction>().get());
-    if (result == 0)
+  public:
+    explicit DedupCompilationDatabase(const CompilationDatabase &base) : m_base(base) {}
+
+    std::vector<CompileCommand> getCompileCommands(llvm::StringRef FilePath) const override
     {
-        result = dump_tool_database();
-    }
-    return result;
+        std::vector<CompileCommand> unique;
+        llvm::StringSet<> seen;
+        for (CompileCommand &command : m_base.getCompileCommands(FilePath))
+        {
+            if (seen.insert(key(command)).second)
+            {
+                unique.push_back(std::move(command));
+            }
+        }
+        return unique;
+    }
+
+    std::vector<std::string> getAllFiles() const override { return m_base.getAllFiles(); }
+
+  private:
+    // A flag whose value is a path, given joined or, unless the flag ends in
+    // '=', as the next argument. Paths relative to the prefix or the sysroot
+    // are compared as written, the others relative to the directory.
+    struct PathFlag
+    {
+        llvm::StringRef name;
+        bool from_directory;
+    };
+
+    static std::string key(const CompileCommand &command)
+    {
+        static const PathFlag PathFlags[] = {
+            {"-I", true},
+            {"-F", true},
+            {"-isystem", true},
+            {"-isystem-after", true},
+            {"-cxx-isystem", true},
+            {"-iquote", true},
+            {"-idirafter", true},
+            {"-iframework", true},
+            {"-iframeworkwithsysroot", false},
+            {"-iprefix", true},
+            {"-iwithprefix", false},
+            {"-iwithprefixbefore", false},
+            {"-imacros", true},
+            {"-include", true},
+            {"-include-pch", true},
+            {"-ivfsoverlay", true},
+            {"-isysroot", true},
+            {"--sysroot", true},
+            {"--sysroot=", true},
+            {"--include-directory", true},
+            {"--include-directory=", true},
+            {"-fmodule-map-file=", true},
+            {"-fmodules-cache-path=", true},
+            {"-fprebuilt-module-path=", true},
+        };
+        auto absolute = [&](llvm::StringRef path) {
+            llvm::SmallString<256> result(path);
+            llvm::sys::fs::make_absolute(command.Directory, result);
+            llvm::sys::path::remove_dots(result, /*remove_dot_dot=*/true);
+            return std::string(result.str());
+        };
+
+        std::string key;
+        const std::vector<std::string> &args = command.CommandLine;
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            llvm::StringRef arg = args[i];
+            if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ")
+            {
+                ++i;
+                continue;
+            }
+            if (arg == "-c" || arg == "-w" || arg == "-MD" || arg == "-MMD" || arg == "-MP" ||
+                (arg.startswith("-W") && !arg.startswith("-Wp,")) ||
+                (arg.startswith("-g") && arg != "-gcc-toolchain") ||
+                arg.startswith("-fdiagnostics-") || arg.endswith("color-diagnostics") ||
+                arg == command.Filename)
+            {
+                continue;
+            }
+            // The longest flag that arg starts with, so that -isystem-after
+            // is not taken for -isystem.
+            const PathFlag *flag = nullptr;
+            for (const PathFlag &candidate : PathFlags)
+            {
+                if (arg.startswith(candidate.name) &&
+                    (flag == nullptr || candidate.name.size() > flag->name.size()))
+                {
+                    flag = &candidate;
+                }
+            }
+            if (flag != nullptr)
+            {
+                llvm::StringRef value = arg.drop_front(flag->name.size());
+                if (arg == flag->name && !flag->name.endswith("=") && i + 1 < args.size())
+                {
+                    value = args[++i];
+                }
+                // -I=dir and the like are relative to the sysroot.
+                bool as_written = !flag->from_directory || value.empty() || value.startswith("=");
+                key += flag->name.rtrim('=');
+                key += as_written ? value.str() : absolute(value);
+            }
+            else
+            {
+                key += arg;
+            }
+            key += '\0';
+        }
+        return key;
+    }
+
+    const CompilationDatabase &m_base;
+};
+
+// The run's extractor, with what class-version adds to the extraction of a
+// source: with --cache-dir, the cached result of a source is used if it is
+// still valid, and a fresh result is stored; ASTs are cheap enough to load
+// that they are not cached. It also collects --stats and traces worker
+// threads for --time-trace.
+class ToolExtractor : public ClassExtractor
+{
+  public:
+    using ClassExtractor::ClassExtractor;
+
+  protected:
+    int extractSource(const CompilationDatabase &Compilations, const std::string &Source,
+                      unsigned tu, ToolDatabase &tdb,
+                      llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS) override
+    {
+        // The profiler records per thread; a worker's events are flushed into
+        // the trace of the main thread when its task ends.
+        bool worker_trace = !TimeTrace.empty() && !llvm::timeTraceProfilerEnabled();
+        if (worker_trace)
+        {
+            llvm::timeTraceProfilerInitialize(TimeTraceGranularity, "class-version");
+        }
+        int result = run_source(Compilations, Source, tu, tdb, FS);
+        if (worker_trace)
+        {
+            llvm::timeTraceProfilerFinishThread();
+        }
+        return result;
+    }
+
+  private:
+    int run_source(const CompilationDatabase &Compilations, const std::string &Source,
+                   unsigned tu, ToolDatabase &tdb,
+                   llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+    {
+        llvm::TimeTraceScope scope("Source", Source);
+        TUStats *stats = global_stats.tus.empty() ? nullptr : &global_stats.tus[tu];
+        auto start = std::chrono::steady_clock::now();
+        int result = 0;
+        auto finish = [&]() {
+            if (stats)
+            {
+                stats->total = seconds_since(start);
+                stats->ran = true;
+                stats->failed = result != 0;
+            }
+            return result;
+        };
+
+        if (isASTFile(Source))
+        {
+            HeaderCache *headers = SkipHarvestedHeaders ? &headerCache() : nullptr;
+            result = extract(Compilations, Source,
+                             {tdb, registry(), headers, tu, true, nullptr, stats}, FS);
+            return finish();
+        }
+
+        std::string cache_key;
+        if (global_cache)
+        {
+            cache_key = SignatureCache::key(Source, Compilations.getCompileCommands(Source));
+            if (global_cache->load(cache_key, tdb))
+            {
+                // Cached classes still take part in ODR checking.
+                for (const ClassDatabase &cdb : tdb.classes())
+                {
+                    if (!cdb.usr_ref().empty())
+                    {
+                        registry().claim(cdb.usr_ref(), cdb.name_ref(), tu, cdb.hasDefinition(),
+                                         cdb.signature());
+                    }
+                }
+                if (stats)
+                {
+                    stats->cached = true;
+                }
+                return finish();
+            }
+        }
+
+        HeaderCache *headers = SkipHarvestedHeaders && !global_cache ? &headerCache() : nullptr;
+        llvm::StringSet<> deps;
+        result = extract(Compilations, Source,
+                         {tdb, registry(), headers, tu, !global_cache,
+                          global_cache ? &deps : nullptr, stats},
+                         FS);
+        if (global_cache && result == 0)
+        {
+            global_cache->store(cache_key, tdb, deps);
+        }
+        return finish();
+    }
+};
+
+// The parse times in seconds that --cost-file holds, by source. A missing or
+// unreadable file has none, so that the first run creates it.
+static llvm::StringMap<double> read_costs()
+{
+    llvm::StringMap<double> costs;
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+        llvm::MemoryBuffer::getFile(CostFile);
+    if (!buffer)
+    {
+        return costs;
+    }
+    llvm::Expected<llvm::json::Value> value = llvm::json::parse(buffer.get()->getBuffer());
+    if (!value)
+    {
+        llvm::errs() << "warning: ignoring " << CostFile << ": "
+                     << llvm::toString(value.takeError()) << "\n";
+        return costs;
+    }
+    const llvm::json::Object *root = value->getAsObject();
+    const llvm::json::Object *sources = root ? root->getObject("sources") : nullptr;
+    if (sources != nullptr)
+    {
+        for (const auto &source : *sources)
+        {
+            if (llvm::Optional<double> seconds = source.second.getAsNumber())
+            {
+                costs[source.first.str()] = *seconds;
+            }
+        }
+    }
+    return costs;
+}
+
+// Store the parse times of this run in --cost-file. Sources that were not
+// parsed, because --stop-when-found skipped them, their cache entry was used
+// or they failed, keep their earlier time. The file is replaced by a rename,
+// so that concurrent runs, such as the shards of one build, never read a
+// partial file; the last one to finish wins.
+static void write_costs()
+{
+    llvm::StringMap<double> costs = global_extractor->options().source_costs;
+    for (size_t i = 0; i < global_stats.sources.size(); ++i)
+    {
+        const TUStats &tu = global_stats.tus[i];
+        if (tu.ran && !tu.cached && !tu.failed)
+        {
+            costs[global_stats.sources[i]] = tu.total;
+        }
+    }
+    llvm::json::Object sources;
+    for (const auto &cost : costs)
+    {
+        sources[cost.getKey()] = cost.getValue();
+    }
+
+    std::error_code ec =
+        write_file_atomically(CostFile, CostFile + "-%%%%%%%%.tmp", [&](llvm::raw_ostream &out) {
+            out << llvm::json::Value(llvm::json::Object{{"sources", std::move(sources)}}) << "\n";
+        });
+    if (ec)
+    {
+        llvm::errs() << "warning: failed to write " << CostFile << ": " << ec.message() << "\n";
+    }
+}
+
+// The files that the JSON output in --hints gives for the -m classes. A
+// missing or malformed output only costs the hints.
+static std::vector<std::string> read_hints()
+{
+    std::vector<std::string> files;
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(Hints);
+    if (!buffer)
+    {
+        llvm::errs() << "warning: cannot read " << Hints << ": " << buffer.getError().message()
+                     << "\n";
+        return files;
+    }
+    llvm::Expected<llvm::json::Value> value = llvm::json::parse(buffer.get()->getBuffer());
+    if (!value)
+    {
+        llvm::errs() << "warning: ignoring " << Hints << ": " << llvm::toString(value.takeError())
+                     << "\n";
+        return files;
+    }
+    llvm::StringSet<> patterns;
+    patterns.insert(matchList.begin(), matchList.end());
+    if (const llvm::json::Array *classes = value->getAsArray())
+    {
+        for (const llvm::json::Value &cls : *classes)
+        {
+            const llvm::json::Object *object = cls.getAsObject();
+            llvm::Optional<llvm::StringRef> name = object ? object->getString("name") : llvm::None;
+            llvm::Optional<llvm::StringRef> file = object ? object->getString("file") : llvm::None;
+            if (name && file && patterns.count(*name))
+            {
+                files.push_back(file->str());
+            }
+        }
+    }
+    return files;
+}
+
+// Create global_extractor from the command line.
+static bool create_extractor()
+{
+    ExtractorOptions options;
+    options.match_kind = MatchMode;
+    options.patterns = matchList;
+    options.templates = Templates;
+    options.skip_function_bodies = FastParse;
+    options.layout = Layout;
+    options.skip_system_headers = SkipSystemHeaders;
+    options.skip_harvested_headers = SkipHarvestedHeaders;
+    options.reuse_preamble = ReusePreamble;
+    options.jobs = Jobs;
+    if (!CostFile.empty())
+    {
+        options.source_costs = read_costs();
+    }
+    if (StopWhenFound)
+    {
+        if (MatchMode != MatchKind::Exact || matchList.empty())
+        {
+            llvm::errs() << "--stop-when-found needs -m classes and --match-kind=exact\n";
+            return false;
+        }
+        options.stop_when_found = true;
+        if (!Hints.empty())
+        {
+            options.hint_files = read_hints();
+        }
+    }
+    global_extractor.reset(new ToolExtractor(std::move(options)));
+    std::string match_error;
+    if (!global_extractor->init(match_error))
+    {
+        llvm::errs() << "Invalid -m pattern: " << match_error << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Run the extraction over every source, handing the databases to sink in
+// source order.
+int run_tool(const CompilationDatabase &Compilations, const std::vector<std::string> &Sources,
+             ResultSink &sink)
+{
+    if (Stats || !CostFile.empty())
+    {
+        global_stats.sources = Sources;
+        global_stats.tus.assign(Sources.size(), TUStats());
+    }
+    int result = global_extractor->run(Compilations, Sources, sink);
+    if (!CostFile.empty())
+    {
+        write_costs();
+    }
+    return result;
+}
+
+int dump_tool_database()
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream out(OutputFilename, ec);
+    if (ec)
+    {
+        llvm::errs() << "Failed to open output file " << OutputFilename << " for writing.";
+        return 1;
+    }
+    out.SetBufferSize(OutputBufferSize);
+
+    if (Format == OutputFormat::Binary)
+    {
+        signature_db::Builder builder;
+        bool dropped_layout = false;
+        for_each_class([&](const ClassDatabase &cdb) {
+            // Only shards extracted with --layout can still have one here.
+            dropped_layout |= cdb.layout().hasValue();
+            uint32_t flags = (cdb.hasDefinition() ? signature_db::ClassDefinition : 0) |
+                             (cdb.odrConflict() ? signature_db::ClassODRConflict : 0);
+            builder.addClass(cdb.name_ref(), cdb.usr_ref(), cdb.signature(), flags, cdb.file_ref(),
+                             cdb.line());
+            for (const FieldDatabase &fdb : cdb.fields())
+            {
+                builder.addField(fdb.type, fdb.variable);
+            }
+        });
+        builder.write(out);
+        if (dropped_layout)
+        {
+            llvm::errs() << "warning: the binary format has no layouts; those of the input are "
+                            "left out\n";
+        }
+    }
+    else
+    {
+        JSONWriter writer(out, Compact);
+        ToolDatabase::beginArray(writer, 0);
+        write_classes(out, [](llvm::raw_ostream &os, llvm::ArrayRef<ClassDatabase> run,
+                              size_t index) {
+            JSONWriter writer(os, Compact);
+            for (const ClassDatabase &cdb : run)
+            {
+                ToolDatabase::writeElement(writer, 0, cdb, index++);
+            }
+        });
+        ToolDatabase::endArray(writer, 0);
+        if (OutputFilename == "-")
+        {
+            out << "\n";
+        }
+    }
+
+    out.flush();
+    global_stats.output_bytes = out.tell();
+    if (out.has_error())
+    {
+        llvm::errs() << "Failed to write output file " << OutputFilename << ": "
+                     << out.error().message() << "\n";
+        out.clear_error();
+        return 1;
+    }
+    return 0;
+}
+
+// The identity of a class in a --baseline comparison: its name and USR.
+static std::string baseline_key(llvm::StringRef name, llvm::StringRef usr)
+{
+    return (name + llvm::StringRef("\0", 1) + usr).str();
+}
+
+// Write the differences between the classes found and a baseline database.
+// Classes are matched by name and USR, so that classes of the same name,
+// such as those of anonymous namespaces in different files, are each
+// compared with their own counterpart. They are compared by signature; only
+// changed ones have their fields compared. Returns 1 if a class was removed
+// or changed.
+int diff_tool_database(const signature_db::Reader &baseline)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream out(OutputFilename, ec);
+    if (ec)
+    {
+        llvm::errs() << "Failed to open output file " << OutputFilename << " for writing.";
+        return 1;
+    }
+    out.SetBufferSize(OutputBufferSize);
+
+    bool incompatible = false;
+    llvm::StringSet<> current;
+    for_each_class([&](const ClassDatabase &cdb) {
+        current.insert(baseline_key(cdb.name_ref(), cdb.usr_ref()));
+        llvm::Optional<signature_db::Reader::Class> old =
+            baseline.find(cdb.name_ref(), cdb.usr_ref());
+        if (!old)
+        {
+            out << "added class " << cdb.name_ref() << "\n";
+            return;
+        }
+        // Without both definitions there is nothing to compare.
+        if (!cdb.hasDefinition() || !(old->flags() & signature_db::ClassDefinition) ||
+            old->signature() == cdb.signature())
+        {
+            return;
+        }
+
+        incompatible = true;
+        out << "changed class " << cdb.name_ref() << "\n";
+        llvm::StringMap<llvm::StringRef> old_fields;
+        for (uint32_t i = 0; i < old->fieldCount(); ++i)
+        {
+            signature_db::Reader::Field field = old->field(i);
+            old_fields.try_emplace(field.variable, field.type);
+        }
+        bool fields_differ = false;
+        for (const FieldDatabase &fdb : cdb.fields())
+        {
+            auto it = old_fields.find(fdb.variable);
+            if (it == old_fields.end())
+            {
+                out << "  added field " << fdb.type << " " << fdb.variable << "\n";
+                fields_differ = true;
+                continue;
+            }
+            if (it->second != fdb.type)
+            {
+                out << "  changed field " << fdb.variable << ": " << it->second << " -> "
+                    << fdb.type << "\n";
+                fields_differ = true;
+            }
+            old_fields.erase(it);
+        }
+        for (uint32_t i = 0; i < old->fieldCount(); ++i)
+        {
+            signature_db::Reader::Field field = old->field(i);
+            if (old_fields.count(field.variable))
+            {
+                out << "  removed field " << field.type << " " << field.variable << "\n";
+                fields_differ = true;
+            }
+        }
+        if (!fields_differ)
+        {
+            out << "  field order, bases or the classes it contains changed\n";
+        }
+    });
+    for (uint32_t i = 0; i < baseline.classCount(); ++i)
+    {
+        signature_db::Reader::Class cls = baseline.getClass(i);
+        if (!current.contains(baseline_key(cls.name(), cls.usr())))
+        {
+            incompatible = true;
+            out << "removed class " << cls.name() << "\n";
+        }
+    }
+
+    out.flush();
+    if (out.has_error())
+    {
+        llvm::errs() << "Failed to write output file " << OutputFilename << ": "
+                     << out.error().message() << "\n";
+        out.clear_error();
+        return 1;
+    }
+    return incompatible ? 1 : 0;
+}
+
+// Answers requests for the classes of single sources from a resident
+// process, so that they cost neither process startup nor, once a source was
+// parsed, another parse. Between requests it keeps the results, one
+// FileManager per compile command directory, since those cache relative
+// paths, and a precompiled preamble of the leading directives of every
+// source parsed, so that parsing a source again after an edit skips its
+// headers.
+//
+// A request only checks the files that its own result depends on, so that
+// answering from a kept result costs a few stats however many are kept. A
+// changed file drops the result. A FileManager caches file sizes, so before
+// it is used for a parse, the files it read are checked too, and it is
+// replaced if one changed. A preamble is rebuilt once a file it covers
+// changes.
+class SignatureServer
+{
+  public:
+    explicit SignatureServer(const CompilationDatabase &Compilations) : m_compilations(Compilations)
+    {
+        global_extractor->retainPreambles();
+    }
+
+    // Parse a source ahead of the first request for it.
+    void warm(llvm::StringRef source)
+    {
+        std::string error;
+        lookup(source, error);
+    }
+
+    // Answer a request line with a line of JSON.
+    std::string handle(llvm::StringRef request)
+    {
+        llvm::StringRef source, class_name;
+        std::tie(source, class_name) = request.split('\t');
+
+        std::string response;
+        llvm::raw_string_ostream out(response);
+        JSONWriter writer(out, /*compact=*/true);
+        std::string error;
+        const ToolDatabase *tdb = lookup(source, error);
+        if (tdb == nullptr)
+        {
+            out << '{';
+            writer.key("error");
+            writer.string(error);
+            out << "}\n";
+            return out.str();
+        }
+
+        out << '[';
+        bool first = true;
+        for (const ClassDatabase &cdb : tdb->classes())
+        {
+            if (!class_name.empty() && cdb.name_ref() != class_name)
+            {
+                continue;
+            }
+            if (!first)
+            {
+                out << ',';
+            }
+            first = false;
+            cdb.write(writer);
+        }
+        out << "]\n";
+        return out.str();
+    }
+
+    // Accept connections on socket_path until a "quit" request.
+    int serve(llvm::StringRef socket_path)
+    {
+#ifdef LLVM_ON_UNIX
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path))
+        {
+            llvm::errs() << "Socket path " << socket_path << " is too long.\n";
+            return 1;
+        }
+        std::memcpy(address.sun_path, socket_path.data(), socket_path.size());
+
+        int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0)
+        {
+            llvm::errs() << "Failed to create socket: " << llvm::sys::StrError() << "\n";
+            return 1;
+        }
+        // A socket left behind by an earlier server would make bind fail,
+        // but anything else at the path is not ours to remove.
+        if (!removeSocket(address.sun_path))
+        {
+            llvm::errs() << "Failed to listen on " << socket_path
+                         << ": the path exists and is not a socket\n";
+            ::close(listener);
+            return 1;
+        }
+        if (::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listener, SOMAXCONN) != 0)
+        {
+            llvm::errs() << "Failed to listen on " << socket_path << ": "
+                         << llvm::sys::StrError() << "\n";
+            ::close(listener);
+            return 1;
+        }
+        // Clients that hang up early must not take the server down.
+        ::signal(SIGPIPE, SIG_IGN);
+
+        for (;;)
+        {
+            int connection = llvm::sys::RetryAfterSignal(-1, ::accept, listener, nullptr, nullptr);
+            if (connection < 0)
+            {
+                llvm::errs() << "Failed to accept a connection: " << llvm::sys::StrError() << "\n";
+                break;
+            }
+            // A client that goes quiet is dropped rather than blocking all
+            // the others.
+            timeval timeout = {ClientTimeoutSeconds, 0};
+            ::setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ::setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            std::string request;
+            if (!readLine(connection, request))
+            {
+                ::close(connection);
+                continue;
+            }
+            if (request == "quit")
+            {
+                ::close(connection);
+                break;
+            }
+            writeAll(connection, handle(request));
+            ::close(connection);
+        }
+        ::close(listener);
+        removeSocket(address.sun_path);
+        return 0;
+#else
+        llvm::errs() << "--serve is only supported on Unix.\n";
+        return 1;
+#endif
+    }
+
+  private:
+    struct FileStamp
+    {
+        llvm::sys::TimePoint<> mtime;
+        uint64_t size;
+    };
+
+    // A result and every file it depends on, as it was when parsed.
+    struct Entry
+    {
+        ToolDatabase tdb;
+        std::vector<std::pair<std::string, FileStamp>> deps;
+    };
+
+    // A FileManager and every file it read, as it was then.
+    struct Files
+    {
+        llvm::IntrusiveRefCntPtr<FileManager> manager;
+        llvm::StringMap<FileStamp> stamps;
+    };
+
+    // The classes of source, parsed now if there is no valid result for it.
+    const ToolDatabase *lookup(llvm::StringRef source, std::string &error)
+    {
+        llvm::SmallString<256> path(source);
+        llvm::sys::fs::make_absolute(path);
+        auto it = m_entries.find(path);
+        if (it != m_entries.end())
+        {
+            if (llvm::all_of(it->second.deps, [](const std::pair<std::string, FileStamp> &dep) {
+                    return unchanged(dep.first, dep.second);
+                }))
+            {
+                return &it->second.tdb;
+            }
+            m_entries.erase(it);
+        }
+
+        std::vector<CompileCommand> commands = m_compilations.getCompileCommands(path);
+        if (commands.empty())
+        {
+            error = "no compile command for " + path.str().str();
+            return nullptr;
+        }
+        Files &files = m_files[commands.front().Directory];
+        if (!files.manager || llvm::any_of(files.stamps, [](const auto &stamp) {
+                return !unchanged(stamp.getKey(), stamp.second);
+            }))
+        {
+            files.manager =
+                new FileManager(FileSystemOptions(), llvm::vfs::createPhysicalFileSystem());
+            files.stamps.clear();
+        }
+        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS(&files.manager->getVirtualFileSystem());
+
+        Entry entry;
+        ClassRegistry registry;
+        llvm::StringSet<> deps;
+        ClangTool Tool(m_compilations, {std::string(path.str())},
+                       std::make_shared<PCHContainerOperations>(), FS, files.manager);
+        std::unique_ptr<FrontendActionFactory> Factory = global_extractor->newActionFactory(
+            {entry.tdb, registry, nullptr, 0, false, &deps, nullptr});
+        if (Tool.run(Factory.get()) != 0)
+        {
+            error = "failed to parse " + path.str().str();
+            return nullptr;
+        }
+        // Files that cannot be read now are not depended on.
+        for (const auto &dep : deps)
+        {
+            FileStamp stamp;
+            if (stampFile(dep.getKey(), stamp))
+            {
+                entry.deps.emplace_back(dep.getKey().str(), stamp);
+                files.stamps.try_emplace(dep.getKey(), stamp);
+            }
+        }
+        return &m_entries.try_emplace(path, std::move(entry)).first->second.tdb;
+    }
+
+    static bool stampFile(llvm::StringRef path, FileStamp &stamp)
+    {
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(path, status))
+        {
+            return false;
+        }
+        stamp = {status.getLastModificationTime(), status.getSize()};
+        return true;
+    }
+
+    static bool unchanged(llvm::StringRef path, const FileStamp &stamp)
+    {
+        FileStamp now;
+        return stampFile(path, now) && now.mtime == stamp.mtime && now.size == stamp.size;
+    }
+
+#ifdef LLVM_ON_UNIX
+    // Seconds a client may take to send its request or read the reply.
+    static const int ClientTimeoutSeconds = 10;
+
+    // Remove the socket at path, if any. Returns false if something other
+    // than a socket is there.
+    static bool removeSocket(const char *path)
+    {
+        struct stat status;
+        if (::lstat(path, &status) != 0)
+        {
+            return true;
+        }
+        if (!S_ISSOCK(status.st_mode))
+        {
+            return false;
+        }
+        ::unlink(path);
+        return true;
+    }
+
+    // Read the request line into line. Returns false if the client timed
+    // out or the connection failed before the line was complete.
+    static bool readLine(int fd, std::string &line)
+    {
+        // Requests are a path and a class name; anything longer is not one.
+        const size_t MaxRequest = 1 << 16;
+        char buffer[4096];
+        while (line.size() < MaxRequest)
+        {
+            ssize_t n = llvm::sys::RetryAfterSignal(-1, ::read, fd, static_cast<char *>(buffer),
+                                                  sizeof(buffer));
+            if (n < 0)
+            {
+                return false;
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            line.append(buffer, n);
+            size_t end = line.find('\n');
+            if (end != std::string::npos)
+            {
+                line.resize(end);
+                break;
+            }
+        }
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        return true;
+    }
+
+    static void writeAll(int fd, llvm::StringRef data)
+    {
+        while (!data.empty())
+        {
+            ssize_t n = llvm::sys::RetryAfterSignal(-1, ::write, fd, data.data(), data.size());
+            if (n <= 0)
+            {
+                return;
+            }
+            data = data.drop_front(n);
+        }
+    }
+#endif
+
+    const CompilationDatabase &m_compilations;
+    llvm::StringMap<Files> m_files;
+    llvm::StringMap<Entry> m_entries;
+};
+
+// The positions of the sources of shard `index` out of `count`. Sources are
+// dealt out largest first, each to the shard with the fewest bytes so far,
+// which depends on nothing but the source list and the file sizes. A shard
+// keeps its sources in their original order.
+std::vector<unsigned> select_shard(const std::vector<std::string> &Sources, unsigned index,
+                                   unsigned count)
+{
+    std::vector<uint64_t> sizes(Sources.size(), 0);
+    std::vector<size_t> order(Sources.size());
+    for (size_t i = 0; i < Sources.size(); ++i)
+    {
+        llvm::sys::fs::file_size(Sources[i], sizes[i]);
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t lhs, size_t rhs) { return sizes[lhs] > sizes[rhs]; });
+
+    std::vector<uint64_t> load(count, 0);
+    std::vector<bool> selected(Sources.size(), false);
+    for (size_t i : order)
+    {
+        unsigned lightest = std::min_element(load.begin(), load.end()) - load.begin();
+        load[lightest] += sizes[i];
+        selected[i] = lightest == index;
+    }
+
+    std::vector<unsigned> shard;
+    for (size_t i = 0; i < Sources.size(); ++i)
+    {
+        if (selected[i])
+        {
+            shard.push_back(i);
+        }
+    }
+    return shard;
+}
+
+// The positions in the full source list of the sources of a --shard run.
+std::vector<unsigned> global_shard_tus;
+
+// Writes the database of every TU of a --shard run in the complete encoding
+// as it is consumed, along with the TU's position in the full source list,
+// for class-version merge. finish() adds the USRs of the classes that the
+// shard found ODR conflicts for.
+class ShardSink : public ResultSink
+{
+  public:
+    explicit ShardSink(llvm::raw_ostream &out) : m_out(out)
+    {
+        m_out << "{\"version\":" << DatabaseFormatVersion << ",\"tus\":[";
+    }
+
+    void consume(ToolDatabase &&tdb) override
+    {
+        m_out << (m_tu == 0 ? "" : ",") << "{\"tu\":" << global_shard_tus[m_tu]
+              << ",\"classes\":[";
+        ++m_tu;
+        bool first = true;
+        for (const ClassDatabase &cdb : tdb.classes())
+        {
+            m_out << (first ? "" : ",") << llvm::json::Value(class_to_json(cdb));
+            first = false;
+            if (!cdb.usr_ref().empty())
+            {
+                m_usrs.insert(cdb.usr_ref());
+            }
+        }
+        m_out << "]}";
+    }
+
+    void finish() override
+    {
+        std::vector<llvm::StringRef> conflicts;
+        for (const auto &usr : m_usrs)
+        {
+            if (global_extractor->registry().isODRConflict(usr.getKey()))
+            {
+                conflicts.push_back(usr.getKey());
+            }
+        }
+        llvm::sort(conflicts);
+        m_out << "],\"conflicts\":" << llvm::json::Value(llvm::json::Array(conflicts)) << "}\n";
+    }
+
+  private:
+    llvm::raw_ostream &m_out;
+    size_t m_tu = 0;
+    llvm::StringSet<> m_usrs;
+};
+
+// Hand the databases of the TUs of the shard outputs to the sink in the
+// order of the full source list, as a run over all sources would, so that
+// merging them gives its output. The ODR conflicts a shard found among its
+// own TUs are carried over, and the registry finds those across shards.
+int merge_shards(const std::vector<std::string> &Inputs, ResultSink &sink)
+{
+    std::vector<std::pair<int64_t, ToolDatabase>> tus;
+    llvm::StringSet<> conflicts;
+    for (const std::string &input : Inputs)
+    {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+            llvm::MemoryBuffer::getFileOrSTDIN(input);
+        if (!buffer)
+        {
+            llvm::errs() << "Failed to read " << input << ": " << buffer.getError().message()
+                         << "\n";
+            return 1;
+        }
+        llvm::Expected<llvm::json::Value> root = llvm::json::parse(buffer.get()->getBuffer());
+        if (!root)
+        {
+            llvm::errs() << "Failed to parse " << input << ": "
+                         << llvm::toString(root.takeError()) << "\n";
+            return 1;
+        }
+        const llvm::json::Object *shard = root->getAsObject();
+        const llvm::json::Array *shard_tus = shard ? shard->getArray("tus") : nullptr;
+        const llvm::json::Array *shard_conflicts = shard ? shard->getArray("conflicts") : nullptr;
+        bool valid = shard_tus != nullptr && shard_conflicts != nullptr &&
+                     shard->getInteger("version") == DatabaseFormatVersion;
+        for (size_t i = 0; valid && i < shard_tus->size(); ++i)
+        {
+            const llvm::json::Object *tu = (*shard_tus)[i].getAsObject();
+            const llvm::json::Array *classes = tu ? tu->getArray("classes") : nullptr;
+            llvm::Optional<int64_t> index = tu ? tu->getInteger("tu") : llvm::None;
+            tus.emplace_back(index.getValueOr(-1), ToolDatabase());
+            valid = classes != nullptr && index && database_from_json(*classes, tus.back().second);
+        }
+        for (size_t i = 0; valid && i < shard_conflicts->size(); ++i)
+        {
+            llvm::Optional<llvm::StringRef> usr = (*shard_conflicts)[i].getAsString();
+            valid = usr.hasValue();
+            conflicts.insert(usr.getValueOr(""));
+        }
+        if (!valid)
+        {
+            llvm::errs() << input << " is not the output of a --shard run of this version.\n";
+            return 1;
+        }
+    }
+
+    std::stable_sort(tus.begin(), tus.end(),
+                     [](const std::pair<int64_t, ToolDatabase> &lhs,
+                        const std::pair<int64_t, ToolDatabase> &rhs) {
+                         return lhs.first < rhs.first;
+                     });
+    for (size_t i = 0; i < tus.size(); ++i)
+    {
+        if (i > 0 && tus[i].first == tus[i - 1].first)
+        {
+            llvm::errs() << "Source " << tus[i].first << " is in more than one shard output.\n";
+            return 1;
+        }
+        ClassRegistry &registry = global_extractor->registry();
+        for (const ClassDatabase &cdb : tus[i].second.classes())
+        {
+            if (cdb.usr_ref().empty())
+            {
+                continue;
+            }
+            registry.claim(cdb.usr_ref(), cdb.name_ref(), unsigned(tus[i].first),
+                           cdb.hasDefinition(), cdb.signature());
+            if (conflicts.count(cdb.usr_ref()))
+            {
+                registry.reportODRConflict(cdb.usr_ref(), cdb.name_ref());
+            }
+        }
+        sink.consume(std::move(tus[i].second));
+    }
+    return 0;
+}
+
+// Produce the databases with `produce` and write them as the output options
+// ask for.
+int write_output(llvm::function_ref<int(ResultSink &)> produce)
+{
+    if (!DepFile.empty() && OutputFilename == "-")
+    {
+        llvm::errs() << "--depfile needs an output file given with -o\n";
+        return 1;
+    }
+    if (Layout && Format == OutputFormat::Binary)
+    {
+        llvm::errs() << "--layout cannot be used with --format=binary, which has no layouts\n";
+        return 1;
+    }
+    std::unique_ptr<signature_db::Reader> baseline;
+    if (!Baseline.empty())
+    {
+        if (Format == OutputFormat::NDJSON)
+        {
+            llvm::errs() << "--baseline cannot be used with --format=ndjson\n";
+            return 1;
+        }
+        llvm::Expected<std::unique_ptr<signature_db::Reader>> reader =
+            signature_db::Reader::open(Baseline);
+        if (!reader)
+        {
+            llvm::errs() << "Failed to load baseline: " << llvm::toString(reader.takeError())
+                         << "\n";
+            return 1;
+        }
+        baseline = std::move(*reader);
+    }
+
+    // Both are written as the TUs are consumed.
+    if (Format == OutputFormat::NDJSON || !Shard.empty())
+    {
+        std::error_code ec;
+        llvm::raw_fd_ostream out(OutputFilename, ec);
+        if (ec)
+        {
+            llvm::errs() << "Failed to open output file " << OutputFilename << " for writing.";
+            return 1;
+        }
+        out.SetBufferSize(OutputBufferSize);
+        std::unique_ptr<ResultSink> sink;
+        if (Shard.empty())
+        {
+            sink.reset(new NDJSONSink(out));
+        }
+        else
+        {
+            sink.reset(new ShardSink(out));
+        }
+        DepFileSink depfile(*sink);
+        int result = produce(DepFile.empty() ? *sink : depfile);
+        sink->finish();
+        out.flush();
+        global_stats.output_bytes = out.tell();
+        if (result == 0 && !DepFile.empty() && !depfile.write(DepFile, OutputFilename))
+        {
+            result = 1;
+        }
+        return result;
+    }
+
+    if (MemoryBudget != 0)
+    {
+        global_spill.reset(new SpillingSink(global_tdb, size_t(MemoryBudget) << 20));
+    }
+    MergingSink merging(global_tdb);
+    ResultSink &sink = global_spill ? static_cast<ResultSink &>(*global_spill) : merging;
+    DepFileSink depfile(sink);
+    int result = produce(DepFile.empty() ? sink : depfile);
+    if (result == 0 && !DepFile.empty() && !depfile.write(DepFile, OutputFilename))
+    {
+        result = 1;
+    }
+    if (global_spill)
+    {
+        global_spill->finish();
+        if (global_spill->failed())
+        {
+            return 1;
+        }
+    }
+    global_tdb.markODRConflicts(global_extractor->registry());
+    if (result == 0)
+    {
+        llvm::TimeTraceScope scope("Output");
+        auto start = std::chrono::steady_clock::now();
+        if (baseline)
+        {
+            result = diff_tool_database(*baseline);
+        }
+        else
+        {
+            result = dump_tool_database();
+        }
+        global_stats.output_time = seconds_since(start);
+        if (global_spill && global_spill->failed())
+        {
+            result = 1;
+        }
+    }
+    return result;
+}
+
+// Print what --stats collected.
+static void print_stats()
+{
+    llvm::raw_ostream &os = llvm::errs();
+    TUStats total;
+    for (size_t i = 0; i < global_stats.tus.size(); ++i)
+    {
+        const TUStats &tu = global_stats.tus[i];
+        os << global_stats.sources[i] << ": ";
+        if (!tu.ran)
+        {
+            os << "skipped\n";
+            continue;
+        }
+        if (tu.cached)
+        {
+            os << llvm::format("%.1f ms, cached", tu.total * 1000);
+        }
+        else
+        {
+            os << llvm::format("%.1f ms parse, %.1f ms traverse", (tu.total - tu.traverse) * 1000,
+                               tu.traverse * 1000);
+        }
+        os << ", " << tu.records_visited << " records visited, " << tu.records_matched
+           << " matched, " << tu.fields << " fields\n";
+        total.total += tu.total;
+        total.traverse += tu.traverse;
+        total.records_visited += tu.records_visited;
+        total.records_matched += tu.records_matched;
+        total.fields += tu.fields;
+    }
+    os << "total: " << global_stats.tus.size() << " TUs, "
+       << llvm::format("%.1f ms parse, %.1f ms traverse", (total.total - total.traverse) * 1000,
+                       total.traverse * 1000)
+       << ", " << total.records_visited << " records visited, " << total.records_matched
+       << " matched, " << total.fields << " fields\n";
+    os << "output: " << global_stats.output_bytes << " bytes"
+       << llvm::format(" in %.1f ms", global_stats.output_time * 1000) << "\n";
+}
+
+// Report --stats and write the --time-trace; returns result, or 1 if the
+// trace could not be written.
+static int finish_run(int result)
+{
+    if (Stats)
+    {
+        print_stats();
+    }
+    if (!TimeTrace.empty())
+    {
+        if (llvm::Error error = llvm::timeTraceProfilerWrite(TimeTrace, OutputFilename))
+        {
+            llvm::errs() << "Failed to write time trace: " << llvm::toString(std::move(error))
+                         << "\n";
+            result = 1;
+        }
+        llvm::timeTraceProfilerCleanup();
+    }
+    return result;
+}
+
+static void start_time_trace(const char *argv0)
+{
+    if (!TimeTrace.empty())
+    {
+        llvm::timeTraceProfilerInitialize(TimeTraceGranularity, llvm::sys::path::filename(argv0));
+    }
+}
+
+// class-version merge [options] <shard output>...
+int merge_main(int argc, const char **argv)
+{
+    // Declared here rather than globally so that it does not clash with the
+    // source list of CommonOptionsParser.
+    static llvm::cl::list<std::string> Inputs(llvm::cl::Positional, llvm::cl::OneOrMore,
+                                              llvm::cl::desc("<shard output> ..."),
+                                              llvm::cl::cat(MyToolCategory));
+    std::vector<const char *> args(argv, argv + argc);
+    args.erase(args.begin() + 1);
+    llvm::cl::HideUnrelatedOptions(MyToolCategory);
+    llvm::cl::ParseCommandLineOptions(args.size(), args.data(),
+                                      "Combines the outputs of --shard runs.\n");
+    if (!Shard.empty())
+    {
+        llvm::errs() << "--shard cannot be used with merge\n";
+        return 1;
+    }
+    // Only the registry of the extractor is used, to check ODR across shards.
+    global_extractor.reset(new ClassExtractor(ExtractorOptions()));
+    start_time_trace(argv[0]);
+    return finish_run(
+        write_output([&](ResultSink &sink) { return merge_shards(Inputs, sink); }));
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc > 1 && llvm::StringRef(argv[1]) == "merge")
+    {
+        return merge_main(argc, argv);
+    }
+
+    CommonOptionsParser OptionsParser(argc, argv, MyToolCategory);
+    DedupCompilationDatabase DedupCompilations(OptionsParser.getCompilations());
+    const CompilationDatabase &Compilations =
+        DedupCommands ? static_cast<const CompilationDatabase &>(DedupCompilations)
+                      : OptionsParser.getCompilations();
+    if (!create_extractor())
+    {
+        return 1;
+    }
+    if (!CacheDir.empty())
+    {
+        if (std::error_code ec = llvm::sys::fs::create_directories(CacheDir))
+        {
+            llvm::errs() << "Failed to create cache directory " << CacheDir << ": "
+                         << ec.message() << "\n";
+            return 1;
+        }
+        global_cache.reset(new SignatureCache(CacheDir));
+    }
+
+    if (!Serve.empty())
+    {
+        SignatureServer server(Compilations);
+        for (const std::string &Source : OptionsParser.getSourcePathList())
+        {
+            server.warm(Source);
+        }
+        return server.serve(Serve);
+    }
+
+    std::vector<std::string> Sources = OptionsParser.getSourcePathList();
+    if (DedupCommands)
+    {
+        // Every TU of a source already runs all of its compile commands.
+        llvm::StringSet<> seen;
+        llvm::erase_if(Sources, [&](const std::string &Source) {
+            llvm::SmallString<256> path(Source);
+            llvm::sys::fs::make_absolute(path);
+            llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+            return !seen.insert(path).second;
+        });
+    }
+    if (!Shard.empty())
+    {
+        unsigned index, count;
+        llvm::StringRef index_text, count_text;
+        std::tie(index_text, count_text) = llvm::StringRef(Shard).split('/');
+        if (index_text.getAsInteger(10, index) || count_text.getAsInteger(10, count) ||
+            count == 0 || index >= count)
+        {
+            llvm::errs() << "Invalid --shard " << Shard << ": expected i/N with 0 <= i < N\n";
+            return 1;
+        }
+        if (Format != OutputFormat::JSON || !Baseline.empty())
+        {
+            llvm::errs() << "--shard writes its own format; pass --format and --baseline to "
+                            "merge instead\n";
+            return 1;
+        }
+        global_shard_tus = select_shard(Sources, index, count);
+        std::vector<std::string> shard;
+        for (unsigned i : global_shard_tus)
+        {
+            shard.push_back(Sources[i]);
+        }
+        Sources = std::move(shard);
+    }
+    start_time_trace(argv[0]);
+    return finish_run(write_output([&](ResultSink &sink) {
+        return run_tool(Compilations, Sources, sink);
+    }));
 }
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include "SignatureDatabase.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <cstring>
+
+namespace signature_db
+{
+
+uint64_t hashName(llvm::StringRef name) { return llvm::xxHash64(name); }
+
+void Builder::addClass(llvm::StringRef name, llvm::StringRef usr, uint64_t signature,
+                       uint32_t flags, llvm::StringRef file, uint32_t line)
+{
+    ClassRecord record;
+    record.name = addString(name);
+    record.usr = addString(usr);
+    record.file = addString(file);
+    record.line = line;
+    record.first_field = m_fields.size();
+    record.field_count = 0;
+    record.flags = flags;
+    record.signature = signature;
+    m_classes.push_back(record);
+}
+
+void Builder::addField(llvm::StringRef type, llvm::StringRef variable)
+{
+    FieldRecord record;
+    record.type = addString(type);
+    record.variable = addString(variable);
+    m_fields.push_back(record);
+    m_classes.back().field_count = m_classes.back().field_count + 1;
+}
+
+StringRecord Builder::addString(llvm::StringRef text)
+{
+    auto inserted = m_string_index.try_emplace(text);
+    if (inserted.second)
+    {
+        inserted.first->second.offset = m_strings.size();
+        inserted.first->second.size = text.size();
+        m_strings.append(text.begin(), text.end());
+    }
+    return inserted.first->second;
+}
+
+void Builder::write(llvm::raw_ostream &out) const
+{
+    std::vector<IndexEntry> index(m_classes.size());
+    for (size_t i = 0; i < m_classes.size(); ++i)
+    {
+        const StringRecord &name = m_classes[i].name;
+        index[i].name_hash = hashName(llvm::StringRef(m_strings).substr(name.offset, name.size));
+        index[i].class_index = i;
+        index[i].reserved = 0;
+    }
+    std::stable_sort(index.begin(), index.end(), [](const IndexEntry &lhs, const IndexEntry &rhs) {
+        return lhs.name_hash < rhs.name_hash;
+    });
+
+    // The record sections need no padding since all their members are
+    // unaligned little-endian integers.
+    Header header;
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.class_count = m_classes.size();
+    header.field_count = m_fields.size();
+    header.reserved = 0;
+    header.strings_offset = sizeof(Header);
+    header.strings_size = m_strings.size();
+    header.classes_offset = header.strings_offset + m_strings.size();
+    header.fields_offset = header.classes_offset + m_classes.size() * sizeof(ClassRecord);
+    header.index_offset = header.fields_offset + m_fields.size() * sizeof(FieldRecord);
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out << m_strings;
+    out.write(reinterpret_cast<const char *>(m_classes.data()),
+              m_classes.size() * sizeof(ClassRecord));
+    out.write(reinterpret_cast<const char *>(m_fields.data()),
+              m_fields.size() * sizeof(FieldRecord));
+    out.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(IndexEntry));
+}
+
+Reader::Field Reader::Class::field(uint32_t i) const
+{
+    // Records are only bounds-checked when used, so that opening a database
+    // does not touch all of it.
+    uint64_t index = uint64_t(m_record->first_field) + i;
+    if (i >= m_record->field_count || index >= m_reader->m_header->field_count)
+    {
+        return {};
+    }
+    const FieldRecord &record = m_reader->m_fields[index];
+    return {m_reader->string(record.type), m_reader->string(record.variable)};
+}
+
+llvm::Expected<std::unique_ptr<Reader>> Reader::open(llvm::StringRef path)
+{
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(
+        path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer)
+    {
+        return llvm::createStringError(buffer.getError(), "cannot open %s: %s", path.str().c_str(),
+                                       buffer.getError().message().c_str());
+    }
+    return create(std::move(*buffer));
+}
+
+llvm::Expected<std::unique_ptr<Reader>> Reader::create(std::unique_ptr<llvm::MemoryBuffer> buffer)
+{
+    std::unique_ptr<Reader> reader(new Reader(std::move(buffer)));
+    if (llvm::Error error = reader->init())
+    {
+        return error;
+    }
+    return reader;
+}
+
+llvm::Error Reader::init()
+{
+    llvm::StringRef data = m_buffer->getBuffer();
+    auto malformed = [&](const char *what) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "%s: not a valid signature database (%s)",
+                                       m_buffer->getBufferIdentifier().str().c_str(), what);
+    };
+
+    if (data.size() < sizeof(Header) || std::memcmp(data.data(), Magic, sizeof(Magic)) != 0)
+    {
+        return malformed("bad magic");
+    }
+    m_header = reinterpret_cast<const Header *>(data.data());
+    if (m_header->version != Version)
+    {
+        return malformed("unsupported version");
+    }
+
+    auto fits = [&](uint64_t offset, uint64_t size) {
+        return offset <= data.size() && size <= data.size() - offset;
+    };
+    uint64_t classes_size = uint64_t(m_header->class_count) * sizeof(ClassRecord);
+    uint64_t fields_size = uint64_t(m_header->field_count) * sizeof(FieldRecord);
+    uint64_t index_size = uint64_t(m_header->class_count) * sizeof(IndexEntry);
+    if (!fits(m_header->strings_offset, m_header->strings_size) ||
+        !fits(m_header->classes_offset, classes_size) ||
+        !fits(m_header->fields_offset, fields_size) || !fits(m_header->index_offset, index_size))
+    {
+        return malformed("truncated");
+    }
+
+    m_strings = data.substr(m_header->strings_offset, m_header->strings_size);
+    m_classes = reinterpret_cast<const ClassRecord *>(data.data() + m_header->classes_offset);
+    m_fields = reinterpret_cast<const FieldRecord *>(data.data() + m_header->fields_offset);
+    m_index = reinterpret_cast<const IndexEntry *>(data.data() + m_header->index_offset);
+    return llvm::Error::success();
+}
+
+llvm::StringRef Reader::string(const StringRecord &record) const
+{
+    // Out-of-range strings read as empty rather than past the section.
+    return m_strings.substr(record.offset, record.size);
+}
+
+llvm::Optional<Reader::Class> Reader::find(llvm::StringRef name) const
+{
+    return findIf(name, [](const Class &) { return true; });
+}
+
+llvm::Optional<Reader::Class> Reader::find(llvm::StringRef name, llvm::StringRef usr) const
+{
+    return findIf(name, [&](const Class &cls) { return cls.usr() == usr; });
+}
+
+llvm::Optional<Reader::Class>
+Reader::findIf(llvm::StringRef name, llvm::function_ref<bool(const Class &)> accept) const
+{
+    uint64_t hash = hashName(name);
+    const IndexEntry *end = m_index + m_header->class_count;
+    const IndexEntry *it =
+        std::lower_bound(m_index, end, hash,
+                         [](const IndexEntry &entry, uint64_t h) { return entry.name_hash < h; });
+    for (; it != end && it->name_hash == hash; ++it)
+    {
+        if (it->class_index < m_header->class_count)
+        {
+            Class cls = getClass(it->class_index);
+            if (cls.name() == name && accept(cls))
+            {
+                return cls;
+            }
+        }
+    }
+    return llvm::None;
+}
+
+} // namespace signature_db
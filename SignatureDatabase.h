@@ -0,0 +1,183 @@
+#ifndef CLASS_SIGNATURE_SIGNATUREDATABASE_H
+#define CLASS_SIGNATURE_SIGNATUREDATABASE_H
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Binary form of the class-version output, written with --format=binary. It
+// carries the information of the JSON output except for --layout, and the
+// USR of every class, laid out so that it can be memory-mapped and queried
+// without reading the whole file.
+//
+// All integers are little-endian. The file is a Header followed by four
+// sections, each located by an offset from the start of the file:
+//   strings  every name, USR, type and variable, deduplicated, back to back
+//   classes  one ClassRecord per class, in output order
+//   fields   one FieldRecord per field; a class owns a contiguous run
+//   index    one IndexEntry per class, sorted by name hash
+namespace signature_db
+{
+
+using llvm::support::ulittle32_t;
+using llvm::support::ulittle64_t;
+
+static const char Magic[8] = {'C', 'L', 'S', 'I', 'G', 'D', 'B', '\0'};
+static const uint32_t Version = 5;
+
+struct Header
+{
+    char magic[8];
+    ulittle32_t version;
+    ulittle32_t class_count;
+    ulittle32_t field_count;
+    ulittle32_t reserved;
+    ulittle64_t strings_offset;
+    ulittle64_t strings_size;
+    ulittle64_t classes_offset;
+    ulittle64_t fields_offset;
+    ulittle64_t index_offset;
+};
+
+// A string in the strings section.
+struct StringRecord
+{
+    ulittle32_t offset;
+    ulittle32_t size;
+};
+
+// Bits of ClassRecord::flags.
+static const uint32_t ClassODRConflict = 1 << 0;
+// The class was defined; declaration-only classes have no fields and a zero
+// signature.
+static const uint32_t ClassDefinition = 1 << 1;
+
+struct ClassRecord
+{
+    StringRecord name;
+    // Identity of the class across TUs; empty if clang could not produce one.
+    StringRecord usr;
+    // Where the class is defined, or declared; empty and 0 if unknown.
+    StringRecord file;
+    ulittle32_t line;
+    ulittle32_t first_field;
+    ulittle32_t field_count;
+    ulittle32_t flags;
+    ulittle64_t signature;
+};
+
+struct FieldRecord
+{
+    StringRecord type;
+    StringRecord variable;
+};
+
+struct IndexEntry
+{
+    ulittle64_t name_hash;
+    ulittle32_t class_index;
+    ulittle32_t reserved;
+};
+
+// Hash used by the index.
+uint64_t hashName(llvm::StringRef name);
+
+// Collects classes and fields and writes them out as a database.
+class Builder
+{
+  public:
+    void addClass(llvm::StringRef name, llvm::StringRef usr, uint64_t signature,
+                  uint32_t flags = 0, llvm::StringRef file = llvm::StringRef(),
+                  uint32_t line = 0);
+
+    // Adds a field to the class added last.
+    void addField(llvm::StringRef type, llvm::StringRef variable);
+
+    void write(llvm::raw_ostream &out) const;
+
+  private:
+    StringRecord addString(llvm::StringRef text);
+
+    std::string m_strings;
+    llvm::StringMap<StringRecord> m_string_index;
+    std::vector<ClassRecord> m_classes;
+    std::vector<FieldRecord> m_fields;
+};
+
+// Read-only view of a database file. The file is memory-mapped; open() only
+// checks the header and section bounds, and name lookups are a binary search
+// of the index.
+class Reader
+{
+  public:
+    struct Field
+    {
+        llvm::StringRef type;
+        llvm::StringRef variable;
+    };
+
+    class Class
+    {
+      public:
+        llvm::StringRef name() const { return m_reader->string(m_record->name); }
+        llvm::StringRef usr() const { return m_reader->string(m_record->usr); }
+        llvm::StringRef file() const { return m_reader->string(m_record->file); }
+        uint32_t line() const { return m_record->line; }
+        uint64_t signature() const { return m_record->signature; }
+        uint32_t flags() const { return m_record->flags; }
+        uint32_t fieldCount() const { return m_record->field_count; }
+        Field field(uint32_t i) const;
+
+      private:
+        friend class Reader;
+        Class(const Reader *reader, const ClassRecord *record) : m_reader(reader), m_record(record)
+        {
+        }
+
+        const Reader *m_reader;
+        const ClassRecord *m_record;
+    };
+
+    static llvm::Expected<std::unique_ptr<Reader>> open(llvm::StringRef path);
+    static llvm::Expected<std::unique_ptr<Reader>>
+    create(std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+    uint32_t classCount() const { return m_header->class_count; }
+
+    Class getClass(uint32_t i) const { return Class(this, &m_classes[i]); }
+
+    // The first class with the given qualified name, if any.
+    llvm::Optional<Class> find(llvm::StringRef name) const;
+
+    // The class with the given qualified name and USR, if any. Several
+    // classes can share a name, such as those of anonymous namespaces in
+    // different files, but not a USR.
+    llvm::Optional<Class> find(llvm::StringRef name, llvm::StringRef usr) const;
+
+  private:
+    llvm::Optional<Class> findIf(llvm::StringRef name,
+                                 llvm::function_ref<bool(const Class &)> accept) const;
+    explicit Reader(std::unique_ptr<llvm::MemoryBuffer> buffer) : m_buffer(std::move(buffer)) {}
+
+    llvm::Error init();
+    llvm::StringRef string(const StringRecord &record) const;
+
+    std::unique_ptr<llvm::MemoryBuffer> m_buffer;
+    const Header *m_header = nullptr;
+    llvm::StringRef m_strings;
+    const ClassRecord *m_classes = nullptr;
+    const FieldRecord *m_fields = nullptr;
+    const IndexEntry *m_index = nullptr;
+};
+
+} // namespace signature_db
+
+#endif
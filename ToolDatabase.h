@@ -0,0 +1,550 @@
+#ifndef CLASS_SIGNATURE_TOOLDATABASE_H
+#define CLASS_SIGNATURE_TOOLDATABASE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Writes the tool's JSON. Indentation is taken from a precomputed run of
+// spaces, strings are escaped, and in compact mode all whitespace is left
+// out. The stream is expected to be a large-buffered raw_ostream.
+class JSONWriter
+{
+  public:
+    JSONWriter(llvm::raw_ostream &out, bool compact) : m_out(out), m_compact(compact) {}
+
+    void indent(unsigned n)
+    {
+        if (m_compact)
+        {
+            return;
+        }
+        static const char Spaces[] =
+            "                                "
+            "                                "
+            "                                "
+            "                                ";
+        const unsigned MaxRun = sizeof(Spaces) - 1;
+        for (; n > MaxRun; n -= MaxRun)
+        {
+            m_out.write(Spaces, MaxRun);
+        }
+        m_out.write(Spaces, n);
+    }
+
+    void newline()
+    {
+        if (!m_compact)
+        {
+            m_out << '\n';
+        }
+    }
+
+    void punct(char c) { m_out << c; }
+
+    void raw(llvm::StringRef text) { m_out << text; }
+
+    // A quoted key and its separator. Pretty output keeps the separators the
+    // format has always used, which differ between keys.
+    void key(llvm::StringRef name, llvm::StringRef pretty_separator = ": ")
+    {
+        m_out << '"' << name << '"';
+        m_out << (m_compact ? llvm::StringRef(":") : pretty_separator);
+    }
+
+    // A 64-bit value as a string of 16 hex digits. JSON readers commonly lose
+    // precision on numbers beyond 53 bits.
+    void hex(uint64_t value) { m_out << '"' << llvm::format_hex_no_prefix(value, 16) << '"'; }
+
+    void boolean(bool value) { m_out << (value ? "true" : "false"); }
+
+    void string(llvm::StringRef text)
+    {
+        m_out << '"';
+        size_t run = 0;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            unsigned char c = text[i];
+            if (c != '"' && c != '\\' && c >= 0x20)
+            {
+                continue;
+            }
+            m_out.write(text.data() + run, i - run);
+            run = i + 1;
+            switch (c)
+            {
+            case '"':
+                m_out << "\\\"";
+                break;
+            case '\\':
+                m_out << "\\\\";
+                break;
+            case '\n':
+                m_out << "\\n";
+                break;
+            case '\t':
+                m_out << "\\t";
+                break;
+            default:
+            {
+                static const char Hex[] = "0123456789abcdef";
+                const char escape[] = {'\\', 'u', '0', '0', Hex[c >> 4], Hex[c & 0xf]};
+                m_out.write(escape, sizeof(escape));
+            }
+            }
+        }
+        m_out.write(text.data() + run, text.size() - run);
+        m_out << '"';
+    }
+
+  private:
+    llvm::raw_ostream &m_out;
+    bool m_compact;
+};
+
+// Fields and the strings they refer to live in the arena of their
+// ToolDatabase.
+struct FieldDatabase
+{
+    llvm::StringRef type;
+    llvm::StringRef variable;
+    // Only known, and written, when the class has a layout. In bits.
+    uint64_t offset = 0;
+    uint64_t size = 0;
+
+    void write(JSONWriter &out, unsigned indent = 0, bool with_layout = false) const
+    {
+        out.indent(indent);
+        out.punct('{');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("type", " : ");
+        out.string(type);
+        out.punct(',');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("variable");
+        out.string(variable);
+        if (with_layout)
+        {
+            out.punct(',');
+            out.newline();
+            out.indent(indent + 4);
+            out.key("offset_bits");
+            out.raw(llvm::utostr(offset));
+            out.punct(',');
+            out.newline();
+            out.indent(indent + 4);
+            out.key("size_bits");
+            out.raw(llvm::utostr(size));
+        }
+        out.newline();
+        out.indent(indent);
+        out.punct('}');
+    }
+};
+
+// Layout of a class definition as the target ABI lays it out.
+struct RecordLayout
+{
+    // Bytes.
+    uint64_t size = 0;
+    uint64_t alignment = 0;
+    bool trivially_copyable = false;
+    bool standard_layout = false;
+    // Bit ranges, as offset and size, that no base, field or vtable pointer
+    // occupies.
+    std::vector<std::pair<uint64_t, uint64_t>> padding;
+
+    void write(JSONWriter &out, unsigned indent = 0) const
+    {
+        out.indent(indent);
+        out.punct('{');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("size");
+        out.raw(llvm::utostr(size));
+        out.punct(',');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("alignment");
+        out.raw(llvm::utostr(alignment));
+        out.punct(',');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("trivially_copyable");
+        out.boolean(trivially_copyable);
+        out.punct(',');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("standard_layout");
+        out.boolean(standard_layout);
+        out.punct(',');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("padding");
+        out.punct('[');
+        for (size_t i = 0; i < padding.size(); ++i)
+        {
+            if (i > 0)
+            {
+                out.punct(',');
+            }
+            out.punct('{');
+            out.key("offset_bits");
+            out.raw(llvm::utostr(padding[i].first));
+            out.punct(',');
+            out.key("size_bits");
+            out.raw(llvm::utostr(padding[i].second));
+            out.punct('}');
+        }
+        out.punct(']');
+        out.newline();
+        out.indent(indent);
+        out.punct('}');
+    }
+};
+
+// A class of a ToolDatabase. Its strings and fields are owned by the
+// database, which is why classes are only created through it.
+class ClassDatabase
+{
+  public:
+    llvm::StringRef name_ref() const { return m_name; }
+
+    llvm::ArrayRef<FieldDatabase> fields() const { return m_fields; }
+
+    std::string name() const { return m_name.str(); }
+
+    // Identity of the class across TUs; empty if clang could not produce one.
+    llvm::StringRef usr_ref() const { return m_usr; }
+
+    bool hasDefinition() const { return m_has_definition; }
+
+    // Where the class is defined, or declared if it has no definition: the
+    // file, empty if unknown, and the line in it.
+    llvm::StringRef file_ref() const { return m_file; }
+
+    unsigned line() const { return m_line; }
+
+    // Fingerprint of the definition, covering its bases and fields, by name,
+    // canonical type and bit width, and, for record types among them, their
+    // own signatures.
+    uint64_t signature() const { return m_signature; }
+
+    void setDefinition(uint64_t signature)
+    {
+        m_has_definition = true;
+        m_signature = signature;
+    }
+
+    // The files that the signature depends on, in sorted order: those that
+    // define the class and the classes, typedefs and enumerations it covers.
+    llvm::ArrayRef<llvm::StringRef> signature_files() const { return m_signature_files; }
+
+    bool odrConflict() const { return m_odr_conflict; }
+
+    const llvm::Optional<RecordLayout> &layout() const { return m_layout; }
+
+    void setLayout(RecordLayout &&layout) { m_layout = std::move(layout); }
+
+    void setODRConflict() { m_odr_conflict = true; }
+
+    void write(JSONWriter &out, unsigned indent = 0) const
+    {
+        out.indent(indent);
+        out.punct('{');
+        out.newline();
+        out.indent(indent + 4);
+        out.key("name");
+        out.string(m_name);
+        out.punct(',');
+        out.newline();
+        if (!m_file.empty())
+        {
+            out.indent(indent + 4);
+            out.key("file");
+            out.string(m_file);
+            out.punct(',');
+            out.newline();
+            out.indent(indent + 4);
+            out.key("line");
+            out.raw(llvm::utostr(m_line));
+            out.punct(',');
+            out.newline();
+        }
+        if (m_has_definition)
+        {
+            out.indent(indent + 4);
+            out.key("signature");
+            out.hex(m_signature);
+            out.punct(',');
+            out.newline();
+        }
+        if (m_odr_conflict)
+        {
+            out.indent(indent + 4);
+            out.key("odr_conflict");
+            out.boolean(true);
+            out.punct(',');
+            out.newline();
+        }
+        if (m_layout)
+        {
+            out.indent(indent + 4);
+            out.key("layout", ":");
+            out.newline();
+            m_layout->write(out, indent + 4);
+            out.punct(',');
+            out.newline();
+        }
+        out.indent(indent + 4);
+        if (m_fields.empty())
+        {
+            out.key("fields");
+            out.raw("[]");
+        }
+        else
+        {
+            out.key("fields", ":");
+            out.newline();
+            out.indent(indent + 4);
+            out.punct('[');
+            out.newline();
+            int iter = 0;
+            for (const FieldDatabase &fdb : m_fields)
+            {
+                if (iter > 0)
+                {
+                    out.punct(',');
+                    out.newline();
+                }
+                iter++;
+                fdb.write(out, indent + 8, m_layout.hasValue());
+            }
+            out.newline();
+            out.indent(indent + 4);
+            out.punct(']');
+        }
+        out.newline();
+        out.indent(indent);
+        out.punct('}');
+    }
+
+  private:
+    friend class ToolDatabase;
+    ClassDatabase(llvm::StringRef name, llvm::StringRef usr) : m_name(name), m_usr(usr) {}
+
+    llvm::ArrayRef<FieldDatabase> m_fields;
+    llvm::ArrayRef<llvm::StringRef> m_signature_files;
+    llvm::StringRef m_name;
+    llvm::StringRef m_usr;
+    llvm::StringRef m_file;
+    unsigned m_line = 0;
+    uint64_t m_signature = 0;
+    llvm::Optional<RecordLayout> m_layout;
+    bool m_has_definition = false;
+    bool m_odr_conflict = false;
+};
+
+// The classes extracted from one or more TUs. Strings are interned in an
+// arena that the database owns, so that a spelling like "int" is stored
+// once rather than once per field, and the fields of a class are one array
+// in the same arena.
+class ToolDatabase
+{
+  public:
+    ToolDatabase() : m_storage(new Storage()) {}
+
+    ClassDatabase &addClass(llvm::StringRef name, llvm::StringRef usr = llvm::StringRef())
+    {
+        return insert(ClassDatabase(intern(name), intern(usr)));
+    }
+
+    llvm::StringRef intern(llvm::StringRef text)
+    {
+        return text.empty() ? llvm::StringRef() : m_storage->strings.save(text);
+    }
+
+    // Give cdb count default fields, to be filled in by the caller. Their
+    // strings must be interned in this database.
+    llvm::MutableArrayRef<FieldDatabase> setFields(ClassDatabase &cdb, size_t count)
+    {
+        llvm::MutableArrayRef<FieldDatabase> fields(
+            m_storage->arena.Allocate<FieldDatabase>(count), count);
+        std::uninitialized_fill(fields.begin(), fields.end(), FieldDatabase());
+        cdb.m_fields = fields;
+        return fields;
+    }
+
+    void setLocation(ClassDatabase &cdb, llvm::StringRef file, unsigned line)
+    {
+        cdb.m_file = intern(file);
+        cdb.m_line = line;
+    }
+
+    void setSignatureFiles(ClassDatabase &cdb, llvm::ArrayRef<llvm::StringRef> files)
+    {
+        llvm::StringRef *ours = m_storage->arena.Allocate<llvm::StringRef>(files.size());
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            new (&ours[i]) llvm::StringRef(intern(files[i]));
+        }
+        cdb.m_signature_files = llvm::makeArrayRef(ours, files.size());
+    }
+
+    const std::vector<ClassDatabase> &classes() const { return m_classes; }
+
+    // Roughly the bytes the database holds, for --memory-budget.
+    size_t memoryUsage() const
+    {
+        return m_storage->arena.getTotalMemory() + m_classes.capacity() * sizeof(ClassDatabase) +
+               m_index.getMemorySize();
+    }
+
+    ClassDatabase *findClass(llvm::StringRef usr)
+    {
+        auto it = m_index.find(usr);
+        return it == m_index.end() ? nullptr : &m_classes[it->second];
+    }
+
+    // Merge the classes of another database into ours. A class we already
+    // hold keeps its position; its fields are only taken over if we had
+    // merely seen a declaration of it. Merging the per-TU databases in source
+    // order reproduces the serial output. The classes taken over are
+    // re-interned, and the other database is left empty.
+    void merge(ToolDatabase &&other)
+    {
+        for (ClassDatabase &cdb : other.m_classes)
+        {
+            ClassDatabase *existing = cdb.usr_ref().empty() ? nullptr : findClass(cdb.usr_ref());
+            if (existing == nullptr)
+            {
+                insert(adopt(std::move(cdb)));
+            }
+            else if (!existing->hasDefinition() && cdb.hasDefinition())
+            {
+                *existing = adopt(std::move(cdb));
+            }
+        }
+        other.m_classes.clear();
+        other.m_index.clear();
+        other.m_storage.reset(new Storage());
+    }
+
+    template <class RegistryType> void markODRConflicts(const RegistryType &registry)
+    {
+        for (ClassDatabase &cdb : m_classes)
+        {
+            if (registry.isODRConflict(cdb.usr_ref()))
+            {
+                cdb.setODRConflict();
+            }
+        }
+    }
+
+    void write(JSONWriter &out, unsigned indent = 0) const
+    {
+        writeArray(out, indent, [&](llvm::function_ref<void(const ClassDatabase &)> write_class) {
+            for (const ClassDatabase &cdb : m_classes)
+            {
+                write_class(cdb);
+            }
+        });
+    }
+
+    // Write the classes that each_class hands out, one at a time, in the
+    // layout of write().
+    static void writeArray(
+        JSONWriter &out, unsigned indent,
+        llvm::function_ref<void(llvm::function_ref<void(const ClassDatabase &)>)> each_class)
+    {
+        beginArray(out, indent);
+        size_t index = 0;
+        each_class([&](const ClassDatabase &cdb) { writeElement(out, indent, cdb, index++); });
+        endArray(out, indent);
+    }
+
+    // The parts of writeArray(), for writers that format runs of classes
+    // separately. writeElement() writes the class at the given position of
+    // the array.
+    static void beginArray(JSONWriter &out, unsigned indent)
+    {
+        out.newline();
+        out.indent(indent);
+        out.punct('[');
+        out.newline();
+    }
+
+    static void writeElement(JSONWriter &out, unsigned indent, const ClassDatabase &cdb,
+                             size_t index)
+    {
+        if (index > 0)
+        {
+            out.punct(',');
+            out.newline();
+        }
+        cdb.write(out, indent + 4);
+    }
+
+    static void endArray(JSONWriter &out, unsigned indent)
+    {
+        out.newline();
+        out.indent(indent);
+        out.punct(']');
+    }
+
+  private:
+    struct Storage
+    {
+        llvm::BumpPtrAllocator arena;
+        llvm::UniqueStringSaver strings{arena};
+    };
+
+    ClassDatabase &insert(ClassDatabase &&cdb)
+    {
+        if (!cdb.usr_ref().empty())
+        {
+            m_index[cdb.usr_ref()] = m_classes.size();
+        }
+        m_classes.emplace_back(std::move(cdb));
+        return m_classes.back();
+    }
+
+    // Move the strings and fields of a class of another database into ours.
+    ClassDatabase adopt(ClassDatabase &&cdb)
+    {
+        cdb.m_name = intern(cdb.m_name);
+        cdb.m_usr = intern(cdb.m_usr);
+        cdb.m_file = intern(cdb.m_file);
+        setSignatureFiles(cdb, cdb.m_signature_files);
+        llvm::ArrayRef<FieldDatabase> theirs = cdb.m_fields;
+        llvm::MutableArrayRef<FieldDatabase> ours = setFields(cdb, theirs.size());
+        for (size_t i = 0; i < theirs.size(); ++i)
+        {
+            ours[i] = theirs[i];
+            ours[i].type = intern(theirs[i].type);
+            ours[i].variable = intern(theirs[i].variable);
+        }
+        return std::move(cdb);
+    }
+
+    // Held by pointer so that moving a database keeps its strings in place.
+    std::unique_ptr<Storage> m_storage;
+    std::vector<ClassDatabase> m_classes;
+    // Keys are interned in m_storage.
+    llvm::DenseMap<llvm::StringRef, size_t> m_index;
+};
+
+#endif
@@ -0,0 +1,507 @@
+// Benchmarks for class-version: micro-benchmarks of the class matcher, of the
+// visitor extracting classes from an in-memory TU and of building, merging
+// and writing databases, and, given a corpus directory and the tool,
+// end-to-end runs of the tool over a synthetic corpus.
+#include "ClassExtractor.h"
+#include "ClassMatcher.h"
+#include "SignatureDatabase.h"
+#include "ToolDatabase.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+static llvm::cl::OptionCategory BenchCategory("class-version-bench options");
+
+static llvm::cl::opt<unsigned> Classes("classes", llvm::cl::desc("Classes in the corpus"),
+                                       llvm::cl::init(2000), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<unsigned> Fields("fields", llvm::cl::desc("Fields per class"),
+                                      llvm::cl::init(8), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<unsigned>
+    TemplateDepth("template-depth",
+                  llvm::cl::desc("Nesting depth of the template types used as field types"),
+                  llvm::cl::init(3), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<unsigned> Headers("headers", llvm::cl::desc("Headers in the corpus"),
+                                       llvm::cl::init(32), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<unsigned> FanOut("fan-out",
+                                      llvm::cl::desc("Headers each source of the corpus includes"),
+                                      llvm::cl::init(8), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<unsigned> Sources("sources", llvm::cl::desc("Sources in the corpus"),
+                                       llvm::cl::init(16), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<unsigned> Repetitions("repetitions",
+                                           llvm::cl::desc("Runs of every benchmark"),
+                                           llvm::cl::init(5), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<std::string>
+    Corpus("corpus",
+           llvm::cl::desc("Directory to generate the corpus in, with a compile_commands.json"),
+           llvm::cl::value_desc("dir"), llvm::cl::cat(BenchCategory));
+
+static llvm::cl::opt<std::string>
+    Tool("tool", llvm::cl::desc("class-version binary to run end to end over the corpus"),
+         llvm::cl::value_desc("path"), llvm::cl::cat(BenchCategory));
+
+// Run `body` Repetitions times and print the median and fastest time, and
+// what `note` says once the runs are done.
+static void measure(llvm::StringRef name, const std::function<void()> &body,
+                    const std::function<std::string()> &note = nullptr)
+{
+    std::vector<double> times;
+    for (unsigned i = 0; i < std::max(1u, unsigned(Repetitions)); ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        times.push_back(elapsed.count());
+    }
+    std::sort(times.begin(), times.end());
+    llvm::outs() << llvm::left_justify(name, 36)
+                 << llvm::format("median %10.3f ms  min %10.3f ms", times[times.size() / 2],
+                                 times.front());
+    if (note)
+    {
+        llvm::outs() << "  " << note();
+    }
+    llvm::outs() << "\n";
+    llvm::outs().flush();
+}
+
+static std::string className(unsigned i)
+{
+    return "bench::ns" + llvm::utostr(i % 16) + "::Class" + llvm::utostr(i);
+}
+
+// Wrap<Wrap<...<int>>> with `depth` levels.
+static std::string wrappedType(unsigned depth)
+{
+    std::string type = "int";
+    for (unsigned i = 0; i < depth; ++i)
+    {
+        type = "bench::Wrap<" + type + ">";
+    }
+    return type;
+}
+
+// Field i of class c: builtins, template types and, once per class, the
+// previous class by value. The chains of classes containing each other are
+// cut every 8 classes so that sizes stay small.
+static std::string fieldType(unsigned c, unsigned i)
+{
+    if (i == 1 && c % 8 != 0)
+    {
+        return className(c - 1);
+    }
+    switch ((c + i) % 4)
+    {
+    case 0:
+        return "int";
+    case 1:
+        return "double";
+    case 2:
+        return wrappedType(TemplateDepth);
+    default:
+        return "unsigned long";
+    }
+}
+
+static const char WrapTemplate[] =
+    "namespace bench {\ntemplate <typename T> struct Wrap { T value; int tag; };\n}\n";
+
+// The definitions of classes [first, last), each in its namespace.
+static std::string classDefinitions(unsigned first, unsigned last)
+{
+    std::string text;
+    for (unsigned c = first; c < last; ++c)
+    {
+        text += "namespace bench { namespace ns" + llvm::utostr(c % 16) + " {\nstruct Class" +
+                llvm::utostr(c) + " {\n";
+        for (unsigned i = 0; i < Fields; ++i)
+        {
+            text += "    " + fieldType(c, i) + " field" + llvm::utostr(i) + ";\n";
+        }
+        text += "};\n} }\n";
+    }
+    return text;
+}
+
+static ToolDatabase makeDatabase(unsigned first, unsigned count)
+{
+    ToolDatabase tdb;
+    for (unsigned c = first; c < first + count; ++c)
+    {
+        std::string name = className(c);
+        ClassDatabase &cdb = tdb.addClass(name, "c:@S@" + name);
+        cdb.setDefinition(c);
+        llvm::MutableArrayRef<FieldDatabase> fields = tdb.setFields(cdb, Fields);
+        for (unsigned i = 0; i < Fields; ++i)
+        {
+            fields[i].type = tdb.intern(fieldType(c, i));
+            fields[i].variable = tdb.intern(name + "::field" + llvm::utostr(i));
+        }
+    }
+    return tdb;
+}
+
+static void benchMatcher()
+{
+    std::vector<std::string> names;
+    for (unsigned c = 0; c < Classes; ++c)
+    {
+        names.push_back(className(c));
+    }
+    struct Case
+    {
+        const char *name;
+        MatchKind kind;
+        std::vector<std::string> patterns;
+    };
+    std::vector<Case> cases = {
+        {"match/substring x64", MatchKind::Substring, {}},
+        {"match/prefix x64", MatchKind::Prefix, {}},
+        {"match/exact x64", MatchKind::Exact, {}},
+        {"match/glob x8", MatchKind::Glob, {}},
+        {"match/regex x8", MatchKind::Regex, {}},
+    };
+    for (unsigned i = 0; i < 64; ++i)
+    {
+        cases[0].patterns.push_back("Class" + llvm::utostr(i * 7));
+        cases[1].patterns.push_back("bench::ns" + llvm::utostr(i % 16) + "::Class" +
+                                    llvm::utostr(i));
+        cases[2].patterns.push_back(className(i * 11));
+    }
+    for (unsigned i = 0; i < 8; ++i)
+    {
+        cases[3].patterns.push_back("bench::ns" + llvm::utostr(i) + "::Class*" + llvm::utostr(i));
+        cases[4].patterns.push_back("ns" + llvm::utostr(i) + "::Class[0-9]*" + llvm::utostr(i));
+    }
+
+    for (const Case &c : cases)
+    {
+        ClassMatcher matcher;
+        std::string error;
+        if (!matcher.compile(c.kind, c.patterns, error))
+        {
+            llvm::errs() << c.name << ": " << error << "\n";
+            continue;
+        }
+        unsigned matched = 0;
+        measure(
+            c.name,
+            [&]() {
+                matched = 0;
+                for (const std::string &name : names)
+                {
+                    matched += matcher.matches(name);
+                }
+            },
+            [&]() { return llvm::utostr(matched) + " of " + llvm::utostr(names.size()); });
+    }
+}
+
+static void benchDatabase()
+{
+    measure("database/build", [&]() { makeDatabase(0, Classes); },
+            [&]() { return llvm::utostr(Classes) + " classes"; });
+
+    const unsigned Shards = std::max(1u, unsigned(Sources));
+    measure("database/merge", [&]() {
+        ToolDatabase merged;
+        // Neighbouring shards overlap by half, as TUs sharing headers do.
+        // Includes building the shards.
+        unsigned per_shard = std::max(1u, Classes / Shards);
+        for (unsigned s = 0; s < Shards; ++s)
+        {
+            merged.merge(makeDatabase(s * per_shard / 2, per_shard));
+        }
+    });
+
+    ToolDatabase tdb = makeDatabase(0, Classes);
+    for (bool compact : {false, true})
+    {
+        std::string out;
+        measure(compact ? "write/json-compact" : "write/json", [&]() {
+            out.clear();
+            llvm::raw_string_ostream os(out);
+            JSONWriter writer(os, compact);
+            tdb.write(writer);
+            os.flush();
+        },
+                [&]() { return llvm::utostr(out.size()) + " bytes"; });
+    }
+
+    std::string binary;
+    measure("write/binary", [&]() {
+        binary.clear();
+        llvm::raw_string_ostream os(binary);
+        signature_db::Builder builder;
+        for (const ClassDatabase &cdb : tdb.classes())
+        {
+            builder.addClass(cdb.name_ref(), cdb.usr_ref(), cdb.signature(),
+                             signature_db::ClassDefinition);
+            for (const FieldDatabase &fdb : cdb.fields())
+            {
+                builder.addField(fdb.type, fdb.variable);
+            }
+        }
+        builder.write(os);
+        os.flush();
+    },
+            [&]() { return llvm::utostr(binary.size()) + " bytes"; });
+
+    llvm::Expected<std::unique_ptr<signature_db::Reader>> reader = signature_db::Reader::create(
+        llvm::MemoryBuffer::getMemBuffer(binary, "bench", /*RequiresNullTerminator=*/false));
+    if (!reader)
+    {
+        llvm::errs() << llvm::toString(reader.takeError()) << "\n";
+        return;
+    }
+    measure("read/binary-find", [&]() {
+        for (const ClassDatabase &cdb : tdb.classes())
+        {
+            (*reader)->find(cdb.name_ref());
+        }
+    });
+}
+
+// Parse one TU with all classes, from memory so that no file system access
+// is timed, and extract every class or a few by exact name. The note gives
+// the time the last run spent traversing the AST, which excludes the parse.
+static void benchVisitor()
+{
+    std::string code = WrapTemplate + classDefinitions(0, Classes);
+    struct Case
+    {
+        const char *name;
+        MatchKind kind;
+        std::vector<std::string> patterns;
+    };
+    std::vector<Case> cases = {
+        {"visitor/all", MatchKind::Substring, {}},
+        {"visitor/exact x64", MatchKind::Exact, {}},
+    };
+    for (unsigned i = 0; i < 64; ++i)
+    {
+        cases[1].patterns.push_back(className(i * 11));
+    }
+
+    for (const Case &c : cases)
+    {
+        ExtractorOptions options;
+        options.match_kind = c.kind;
+        options.patterns = c.patterns;
+        ClassExtractor extractor(std::move(options));
+        std::string error;
+        if (!extractor.init(error))
+        {
+            llvm::errs() << c.name << ": " << error << "\n";
+            continue;
+        }
+        TUStats stats;
+        measure(
+            c.name,
+            [&]() {
+                ToolDatabase tdb;
+                stats = TUStats();
+                ExtractionTarget target{tdb, extractor.registry(), nullptr, 0, false, nullptr,
+                                        &stats};
+                if (!clang::tooling::runToolOnCodeWithArgs(
+                        extractor.newActionFactory(target)->create(), code, {"-std=c++17"},
+                        "bench.cpp"))
+                {
+                    llvm::errs() << c.name << ": failed to parse\n";
+                }
+            },
+            [&]() {
+                std::string note;
+                llvm::raw_string_ostream os(note);
+                os << llvm::format("traverse %.3f ms, ", stats.traverse * 1000)
+                   << stats.records_matched << " of " << stats.records_visited << " records";
+                return os.str();
+            });
+    }
+}
+
+static bool writeFile(const llvm::Twine &path, llvm::StringRef contents)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path.str(), ec);
+    if (ec)
+    {
+        llvm::errs() << "Failed to write " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+    out << contents;
+    return true;
+}
+
+// Classes are spread over the headers in order, so that a class only uses
+// classes of its own or earlier headers; header h includes header h - 1.
+// Source s includes FanOut headers and defines a few classes of its own.
+// All sources start alike up to their first, indented, include, so that
+// --reuse-preamble shares a preamble that ends in the middle of a line.
+static bool generateCorpus(llvm::StringRef dir, std::vector<std::string> &sources)
+{
+    if (std::error_code ec = llvm::sys::fs::create_directories(dir))
+    {
+        llvm::errs() << "Failed to create " << dir << ": " << ec.message() << "\n";
+        return false;
+    }
+    const unsigned HeaderCount = std::max(1u, unsigned(Headers));
+    unsigned per_header = (Classes + HeaderCount - 1) / HeaderCount;
+
+    if (!writeFile(dir + "/wrap.h", std::string("#pragma once\n") + WrapTemplate))
+    {
+        return false;
+    }
+    for (unsigned h = 0; h < HeaderCount; ++h)
+    {
+        std::string text = "#pragma once\n";
+        text += h == 0 ? "#include \"wrap.h\"\n" : "#include \"h" + llvm::utostr(h - 1) + ".h\"\n";
+        text += classDefinitions(std::min(unsigned(Classes), h * per_header),
+                                 std::min(unsigned(Classes), (h + 1) * per_header));
+        if (!writeFile(dir + "/h" + llvm::utostr(h) + ".h", text))
+        {
+            return false;
+        }
+    }
+
+    llvm::json::Array commands;
+    for (unsigned s = 0; s < Sources; ++s)
+    {
+        std::string text = "#include \"wrap.h\"\n// The headers of this source.\n";
+        for (unsigned i = 0; i < std::min(unsigned(FanOut), HeaderCount); ++i)
+        {
+            text += "  #include \"h" + llvm::utostr((s * 7 + i * 3) % HeaderCount) + ".h\"\n";
+        }
+        text += "namespace bench { namespace local" + llvm::utostr(s) + " {\n";
+        for (unsigned c = 0; c < 8; ++c)
+        {
+            text += "struct Local" + llvm::utostr(c) + " { int a; " +
+                    wrappedType(TemplateDepth) + " b; };\n";
+        }
+        text += "} }\n";
+        std::string name = "tu" + llvm::utostr(s) + ".cpp";
+        if (!writeFile(dir + "/" + name, text))
+        {
+            return false;
+        }
+
+        llvm::SmallString<256> path(dir);
+        llvm::sys::path::append(path, name);
+        sources.push_back(std::string(path.str()));
+        commands.push_back(llvm::json::Object{{"directory", dir},
+                                              {"file", name},
+                                              {"command", "clang++ -std=c++17 -c " + name}});
+    }
+    std::string text;
+    llvm::raw_string_ostream os(text);
+    os << llvm::json::Value(std::move(commands)) << "\n";
+    return writeFile(dir + "/compile_commands.json", os.str());
+}
+
+static llvm::Optional<std::string> readFile(const llvm::Twine &path)
+{
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+    {
+        return llvm::None;
+    }
+    return buffer.get()->getBuffer().str();
+}
+
+// Time the tool over the corpus with several option sets. Those that must
+// not change the output are also checked against the first one; returns
+// false if one does.
+static bool benchEndToEnd()
+{
+    llvm::SmallString<256> dir(Corpus);
+    llvm::sys::fs::make_absolute(dir);
+    std::vector<std::string> sources;
+    if (!generateCorpus(dir, sources))
+    {
+        return false;
+    }
+    if (Tool.empty())
+    {
+        llvm::outs() << "Corpus written to " << dir << "; pass --tool to run it.\n";
+        return true;
+    }
+
+    struct Variant
+    {
+        std::string name;
+        std::vector<std::string> args;
+        bool same_output;
+    };
+    std::vector<Variant> variants = {
+        {"e2e/default", {}, true},
+        {"e2e/reuse-preamble", {"--reuse-preamble"}, true},
+        {"e2e/fast", {"--fast"}, false},
+        {"e2e/fast-j0", {"--fast", "-j", "0"}, false},
+        {"e2e/fast-skip-harvested", {"--fast", "--skip-harvested-headers"}, false},
+    };
+    bool same = true;
+    for (size_t v = 0; v < variants.size(); ++v)
+    {
+        const Variant &variant = variants[v];
+        std::string output = (dir + "/out" + llvm::utostr(v) + ".json").str();
+        std::vector<llvm::StringRef> args = {Tool, "-p", dir, "-o", output};
+        for (const std::string &arg : variant.args)
+        {
+            args.push_back(arg);
+        }
+        for (const std::string &source : sources)
+        {
+            args.push_back(source);
+        }
+        int status = 0;
+        measure(variant.name, [&]() {
+            std::string error;
+            status = llvm::sys::ExecuteAndWait(Tool, args, llvm::None, {}, 0, 0, &error);
+            if (status != 0)
+            {
+                llvm::errs() << variant.name << ": exit " << status << " " << error << "\n";
+            }
+        });
+        if (v > 0 && variant.same_output && readFile(output) != readFile(dir + "/out0.json"))
+        {
+            llvm::errs() << variant.name << ": output differs from " << variants[0].name << "\n";
+            same = false;
+        }
+    }
+    return same;
+}
+
+int main(int argc, const char **argv)
+{
+    llvm::cl::HideUnrelatedOptions(BenchCategory);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Benchmarks for class-version\n");
+
+    benchMatcher();
+    benchVisitor();
+    benchDatabase();
+    if (!Corpus.empty() && !benchEndToEnd())
+    {
+        return 1;
+    }
+    return 0;
+}